@@ -0,0 +1,240 @@
+/*
+    fbv  --  simple image viewer for the linux framebuffer
+    Copyright (C) 2000  Tomasz Sterna
+    Copyright (C) 2003  Mateusz Golicz
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Microbenchmarks, built with 'make bench' and not installed.
+ *
+ *	fbv-bench convert	row converters, plain C against the one
+ *				selectRGB2FB() picks, in Mpixel/s per format
+ *	fbv-bench resize [n]	the resize kernels on 1 to n worker threads
+ *				(default 4), in ms per image and the speedup
+ *				over one thread
+ *
+ * convert.c is included whole so its plain converters can be called
+ * by name; the output of the two is compared as well. The resized
+ * images must not depend on the number of threads either.
+ */
+
+#include <time.h>
+#include "convert.c"
+
+#define BENCH_ROW 1920			/* pixels in a row */
+#define BENCH_NS 200000000LL		/* time spent on each kernel */
+#define BENCH_W 3000			/* source image for the resize kernels */
+#define BENCH_H 2000
+#define BENCH_FIT_W 1620		/* ... fitted to a 1920x1080 screen */
+#define BENCH_FIT_H 1080
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* rows of pixels for at least BENCH_NS, in Mpixel/s */
+static double convert_rate(fb_convert_fn fn, void *dst, const unsigned char *src)
+{
+	long long start = now_ns(), t;
+	long rows = 0;
+	int i;
+
+	do
+	{
+		for(i = 0; i < 64; i++)
+			fn(dst, src, BENCH_ROW);
+		rows += 64;
+		t = now_ns() - start;
+	}
+	while(t < BENCH_NS);
+	return (double) rows * BENCH_ROW * 1000.0 / t;
+}
+
+static const struct
+{
+	const char *name;
+	struct fb_format fmt;
+	fb_convert_fn plain;
+} formats[] =
+{
+	{ "RGB332",   {  8, 1, 1, { 0, 8 },  { 0, 8 }, { 0, 8 }, { 0, 0 } },  convert8 },
+	{ "RGB555",   { 15, 2, 0, { 10, 5 }, { 5, 5 }, { 0, 5 }, { 0, 0 } },  convert15 },
+	{ "RGB565",   { 16, 2, 0, { 11, 5 }, { 5, 6 }, { 0, 5 }, { 0, 0 } },  convert16 },
+	{ "BGR666",   { 24, 3, 0, { 12, 6 }, { 6, 6 }, { 0, 6 }, { 0, 0 } },  convert24 },
+	{ "RGB888",   { 24, 3, 0, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 0, 0 } },  convert24_888 },
+	{ "XRGB8888", { 32, 4, 0, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 0, 0 } },  convert32 },
+	{ "ARGB8888", { 32, 4, 0, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 24, 8 } }, convert32a },
+};
+
+static int bench_convert(void)
+{
+	unsigned char src[BENCH_ROW * 3], a[BENCH_ROW * 4], b[BENCH_ROW * 4];
+	unsigned int i;
+	int bad = 0;
+
+	srand(1);
+	for(i = 0; i < sizeof(src); i++)
+		src[i] = rand();
+
+	printf("%-10s %12s %12s %8s\n", "format", "C Mpix/s", "used Mpix/s", "speedup");
+	for(i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	{
+		fb_convert_fn used = selectRGB2FB(&formats[i].fmt);
+		double c, v;
+
+		formats[i].plain(a, src, BENCH_ROW);
+		used(b, src, BENCH_ROW);
+		if(memcmp(a, b, BENCH_ROW * formats[i].fmt.cpp))
+		{
+			printf("%-10s output differs from the C converter\n", formats[i].name);
+			bad = 1;
+			continue;
+		}
+		c = convert_rate(formats[i].plain, a, src);
+		v = (used == formats[i].plain) ? c : convert_rate(used, b, src);
+		printf("%-10s %12.0f %12.0f %7.2fx\n", formats[i].name, c, v, v / c);
+	}
+	return bad;
+}
+
+static const struct
+{
+	const char *name;
+	int kernel;
+} resizers[] =
+{
+	{ "nearest",  -1 },
+	{ "average",  RESIZE_AVERAGE },
+	{ "bilinear", RESIZE_BILINEAR },
+	{ "lanczos",  RESIZE_LANCZOS },
+	{ "half",     -2 },
+};
+
+static unsigned char *resize_once(int kernel, unsigned char *src)
+{
+	switch(kernel)
+	{
+		case -1:
+			return simple_resize(src, BENCH_W, BENCH_H, BENCH_FIT_W, BENCH_FIT_H);
+		case -2:
+			return half_resize(src, BENCH_W, BENCH_H, 3);
+		case RESIZE_AVERAGE:
+			return color_average_resize(src, BENCH_W, BENCH_H, BENCH_FIT_W, BENCH_FIT_H);
+	}
+	return filter_resize(src, BENCH_W, BENCH_H, BENCH_FIT_W, BENCH_FIT_H, 3, kernel);
+}
+
+/* images resized for at least BENCH_NS, in ms per image; NULL in *out for no memory */
+static double resize_ms(int kernel, unsigned char *src, unsigned char **out)
+{
+	long long start = now_ns(), t;
+	long n = 0;
+
+	*out = NULL;
+	do
+	{
+		pool_free(*out);
+		if(!(*out = resize_once(kernel, src)))
+			return 0;
+		n++;
+		t = now_ns() - start;
+	}
+	while(t < BENCH_NS);
+	return t / 1e6 / n;
+}
+
+static int bench_resize(int maxthreads)
+{
+	size_t len[sizeof(resizers) / sizeof(resizers[0])];
+	unsigned char *src, *one[sizeof(resizers) / sizeof(resizers[0])], *out;
+	double ms[sizeof(resizers) / sizeof(resizers[0])];
+	unsigned int i;
+	int n, bad = 0;
+
+	if(!(src = (unsigned char *) pool_alloc(BENCH_W * BENCH_H * 3)))
+	{
+		fprintf(stderr, "no memory for the source image\n");
+		return 1;
+	}
+	srand(1);
+	for(i = 0; i < BENCH_W * BENCH_H * 3; i++)
+		src[i] = rand();
+	for(i = 0; i < sizeof(resizers) / sizeof(resizers[0]); i++)
+		len[i] = (resizers[i].kernel == -2) ? (BENCH_W / 2) * (BENCH_H / 2) * 3 : BENCH_FIT_W * BENCH_FIT_H * 3;
+
+	printf("%dx%d to %dx%d, half to %dx%d\n", BENCH_W, BENCH_H, BENCH_FIT_W, BENCH_FIT_H, BENCH_W / 2, BENCH_H / 2);
+	printf("%-8s", "threads");
+	for(i = 0; i < sizeof(resizers) / sizeof(resizers[0]); i++)
+		printf(" %10s%7s", resizers[i].name, "");
+	printf("\n");
+
+	for(n = 1; n <= maxthreads; n++)
+	{
+		threads_init(n);
+		printf("%-8d", threads_count());
+		for(i = 0; i < sizeof(resizers) / sizeof(resizers[0]); i++)
+		{
+			double t = resize_ms(resizers[i].kernel, src, &out);
+
+			if(!out)
+			{
+				printf(" %10s%7s", "no memory", "");
+				bad = 1;
+				if(n == 1)
+					one[i] = NULL;
+				continue;
+			}
+			if(n == 1)
+			{
+				ms[i] = t;
+				one[i] = out;
+				printf(" %8.1fms       ", t);
+				continue;
+			}
+			if(one[i] && memcmp(one[i], out, len[i]))
+			{
+				printf(" %10s%7s", "differs", "");
+				bad = 1;
+			}
+			else
+				printf(" %8.1fms %5.2fx", t, ms[i] / t);
+			pool_free(out);
+		}
+		printf("\n");
+		threads_exit();
+	}
+
+	for(i = 0; i < sizeof(resizers) / sizeof(resizers[0]); i++)
+		pool_free(one[i]);
+	pool_free(src);
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 1 && !strcmp(argv[1], "convert"))
+		return bench_convert();
+	if(argc > 1 && !strcmp(argv[1], "resize"))
+		return bench_resize((argc > 2) ? max(atoi(argv[2]), 1) : 4);
+
+	fprintf(stderr, "Usage: %s convert\n       %s resize [threads]\n", argv[0], argv[0]);
+	return 1;
+}
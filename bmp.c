@@ -19,12 +19,12 @@
 */
 #include "config.h"
 #ifdef FBV_SUPPORT_BMP
-#include "fbv.h"
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "fbv.h"
 
 #define BMP_TORASTER_OFFSET	10
 #define BMP_SIZE_OFFSET		18
@@ -80,7 +80,7 @@ int fh_bmp_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 	unsigned char *bp, *wr_buffer;
 	struct color pallete[256];
 
-	wr_buffer = (unsigned char*)malloc(x*y*3);
+	wr_buffer = (unsigned char*)pool_alloc(x*y*3);
 	if (!wr_buffer)
 		return FH_ERROR_MEM;
 	bp = wr_buffer + x*(y-1)*3;
@@ -91,14 +91,14 @@ int fh_bmp_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 	}
 
 	if (lseek(fd, BMP_TORASTER_OFFSET, SEEK_SET) == -1) {
-		free(wr_buffer);
+		pool_free(wr_buffer);
 		return(FH_ERROR_FORMAT);
 	}
 	read(fd, buff, 4);
 	raster = buff[0] + (buff[1]<<8) + (buff[2]<<16) + (buff[3]<<24);
 
 	if (lseek(fd, BMP_BPP_OFFSET, SEEK_SET) == -1) {
-		free(wr_buffer);
+		pool_free(wr_buffer);
 		return(FH_ERROR_FORMAT);
 	}
 	read(fd, buff, 2);
@@ -194,7 +194,7 @@ int fh_bmp_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 			}
 			break;
 		case 16: /* 16bit RGB */
-			free(wr_buffer);
+			pool_free(wr_buffer);
 			return(FH_ERROR_FORMAT);
 			break;
 		case 24: /* 24bit RGB */
@@ -214,7 +214,7 @@ int fh_bmp_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 			}
 			break;
 		default:
-			free(wr_buffer);
+			pool_free(wr_buffer);
 			return(FH_ERROR_FORMAT);
 	}
 
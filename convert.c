@@ -0,0 +1,904 @@
+/*
+    fbv  --  simple image viewer for the linux framebuffer
+    Copyright (C) 2000  Tomasz Sterna
+    Copyright (C) 2003  Mateusz Golicz
+
+    Copyright (C) 2011  Marco Cavallini <m.cavallini@koansoftware.com>
+    Added BGR666@24bpp
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * RGB -> framebuffer pixel format row converters.
+ *
+ * The pixel layout comes from the red/green/blue/transp bitfields the
+ * driver reports. Any layout works through the table driven generic
+ * converter; the common ones (RGB565, RGB555, BGR666 and RGB888 at
+ * 24bpp, XRGB8888 and ARGB8888) have their own.
+ *
+ * Every fast format has a plain C converter; on x86 there are SSE2 and AVX2
+ * versions (AVX2 is picked at run time) and on ARM there is a NEON one.
+ * The vector versions produce exactly the same bytes as the C ones, and
+ * leave the last few pixels of a row to them.
+ *
+ * The unpackers go the other way, framebuffer -> RGB, and blend_row()
+ * composes RGB pixels over others; together they give alpha blending
+ * against whatever is on screen. dither_row() prepares a row for a
+ * format with fewer than 8 bits a channel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "fbv.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define FBV_SSE2
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define FBV_AVX2
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FBV_NEON
+#endif
+
+inline static unsigned char make8color(unsigned char r, unsigned char g, unsigned char b)
+{
+    return (
+	(((r >> 5) & 7) << 5) |
+	(((g >> 5) & 7) << 2) |
+	 ((b >> 6) & 3)       );
+}
+
+inline static unsigned short make15color(unsigned char r, unsigned char g, unsigned char b)
+{
+    return (
+	(((r >> 3) & 31) << 10) |
+	(((g >> 3) & 31) << 5)  |
+	 ((b >> 3) & 31)        );
+}
+
+inline static unsigned short make16color(unsigned char r, unsigned char g, unsigned char b)
+{
+    return (
+	(((r >> 3) & 31) << 11) |
+	(((g >> 2) & 63) << 5)  |
+	 ((b >> 3) & 31)        );
+}
+
+static void convert8(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+    unsigned int i;
+    u_int8_t *c_fbbuff = (u_int8_t *) dst;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+	c_fbbuff[i] = make8color(rgbbuff[0], rgbbuff[1], rgbbuff[2]);
+}
+
+static void convert15(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+    unsigned int i;
+    u_int16_t *s_fbbuff = (u_int16_t *) dst;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+	s_fbbuff[i] = make15color(rgbbuff[0], rgbbuff[1], rgbbuff[2]);
+}
+
+static void convert16(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+    unsigned int i;
+    u_int16_t *s_fbbuff = (u_int16_t *) dst;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+	s_fbbuff[i] = make16color(rgbbuff[0], rgbbuff[1], rgbbuff[2]);
+}
+
+static void convert24(void *dst, const unsigned char *rgbbuff, unsigned int count)  /* BGR666 */
+{
+    unsigned int i;
+    u_int8_t *c_fbbuff = (u_int8_t *) dst;
+
+    for(i = 0; i < count * 3; i += 3)
+	{   // Skip 24 bit at a time
+	    c_fbbuff[i + 0] = (u_int8_t)( (rgbbuff[i+2] >> 2) | ((rgbbuff[i+1] & 0x0C) << 4) );
+	    c_fbbuff[i + 1] = (u_int8_t)( ((rgbbuff[i+1] & 0xF0) >> 4) | ((rgbbuff[i+0] & 0x3C) << 2) );
+	    c_fbbuff[i + 2] = (u_int8_t)( (rgbbuff[i+0] & 0xC0) >> 6 );
+	}
+}
+
+static void convert24_888(void *dst, const unsigned char *rgbbuff, unsigned int count)  /* RGB888 */
+{
+    unsigned int i;
+    u_int8_t *c_fbbuff = (u_int8_t *) dst;
+
+    for(i = 0; i < count * 3; i += 3)
+	{
+	    c_fbbuff[i + 0] = rgbbuff[i + 2];
+	    c_fbbuff[i + 1] = rgbbuff[i + 1];
+	    c_fbbuff[i + 2] = rgbbuff[i + 0];
+	}
+}
+
+static void convert32(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+    unsigned int i;
+    u_int32_t *i_fbbuff = (u_int32_t *) dst;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+	i_fbbuff[i] = ((rgbbuff[0] << 16) & 0xFF0000) |
+		    ((rgbbuff[1] << 8) & 0xFF00) |
+		    (rgbbuff[2] & 0xFF);
+}
+
+static void convert32a(void *dst, const unsigned char *rgbbuff, unsigned int count)  /* ARGB8888, opaque */
+{
+    unsigned int i;
+    u_int32_t *i_fbbuff = (u_int32_t *) dst;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+	i_fbbuff[i] = 0xFF000000 |
+		    ((rgbbuff[0] << 16) & 0xFF0000) |
+		    ((rgbbuff[1] << 8) & 0xFF00) |
+		    (rgbbuff[2] & 0xFF);
+}
+
+/*
+ * Any other layout: per channel tables hold the value already moved
+ * into place, the pixel is the OR of three lookups (and an all ones
+ * transp field, pixels we write are opaque).
+ */
+static struct
+{
+    int cpp;
+    u_int32_t r[256], g[256], b[256];
+    u_int32_t a;
+} gen;
+
+static void convert_generic(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+    unsigned int i;
+    u_int32_t v;
+    u_int8_t *d = (u_int8_t *) dst;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+    {
+	v = gen.r[rgbbuff[0]] | gen.g[rgbbuff[1]] | gen.b[rgbbuff[2]] | gen.a;
+	switch(gen.cpp)
+	{
+	    case 1:
+		d[i] = v;
+		break;
+	    case 2:
+		((u_int16_t *) d)[i] = v;
+		break;
+	    case 3:
+		d[i * 3 + 0] = v;
+		d[i * 3 + 1] = v >> 8;
+		d[i * 3 + 2] = v >> 16;
+		break;
+	    default:
+		((u_int32_t *) d)[i] = v;
+	}
+    }
+}
+
+/* all ones in a field of 'length' bits */
+static inline u_int32_t field_mask(int length)
+{
+    return (length >= 32) ? 0xFFFFFFFF : (1U << length) - 1;
+}
+
+/* an 8 bit channel value scaled to 'length' bits */
+static u_int32_t narrow(unsigned int v, int length)
+{
+    if(length <= 0)
+	return 0;
+    if(length <= 8)
+	return v >> (8 - length);
+    if(length <= 24)
+	return v * field_mask(length) / 255;
+    return v << (length - 8);
+}
+
+static void setup_generic(const struct fb_format *fmt)
+{
+    int i;
+
+    gen.cpp = fmt->cpp;
+    for(i = 0; i < 256; i++)
+    {
+	gen.r[i] = narrow(i, fmt->red.length) << fmt->red.offset;
+	gen.g[i] = narrow(i, fmt->green.length) << fmt->green.offset;
+	gen.b[i] = narrow(i, fmt->blue.length) << fmt->blue.offset;
+    }
+    gen.a = fmt->transp.length ? field_mask(fmt->transp.length) << fmt->transp.offset : 0;
+}
+
+#if defined(FBV_SSE2) || defined(FBV_AVX2)
+/*
+ * On x86 four (SSE2) or eight (AVX2) pixels are loaded into 32 bit lanes
+ * as r | g << 8 | b << 16, with junk in the top byte. Each format is then
+ * a couple of masks and shifts per lane.
+ */
+#define PACK565(x, AND, SL, SR, OR, C) \
+	OR(OR(SL(AND(x, C(0xF8)), 8), AND(SR(x, 5), C(0x07E0))), AND(SR(x, 19), C(0x001F)))
+#define PACK555(x, AND, SL, SR, OR, C) \
+	OR(OR(SL(AND(x, C(0xF8)), 7), AND(SR(x, 6), C(0x03E0))), AND(SR(x, 19), C(0x001F)))
+#define PACK666(x, AND, SL, SR, OR, C) \
+	OR(OR(SL(AND(x, C(0xFC)), 10), AND(SR(x, 4), C(0x0FC0))), AND(SR(x, 18), C(0x003F)))
+#define PACK888(x, AND, SL, SR, OR, C) \
+	OR(OR(SL(AND(x, C(0xFF)), 16), AND(x, C(0xFF00))), AND(SR(x, 16), C(0x00FF)))
+#endif
+
+#ifdef FBV_SSE2
+#define SSE_C(v)	_mm_set1_epi32(v)
+
+static inline __m128i load4_sse2(const unsigned char *p)
+{
+	u_int32_t a, b, c, d;
+
+	/* reads one byte past the fourth pixel */
+	memcpy(&a, p, 4);
+	memcpy(&b, p + 3, 4);
+	memcpy(&c, p + 6, 4);
+	memcpy(&d, p + 9, 4);
+	return _mm_setr_epi32(a, b, c, d);
+}
+
+/* two vectors of 32 bit lanes holding values below 0x10000 -> 8 x u16 */
+static inline __m128i pack16_sse2(__m128i a, __m128i b)
+{
+	a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+	b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+	return _mm_packs_epi32(a, b);
+}
+
+#define SSE2_CONVERT16(name, PACK, tail) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	unsigned int i = 0; \
+	u_int16_t *d = (u_int16_t *) dst; \
+	for(; i + 9 <= count; i += 8, rgbbuff += 24) \
+	{ \
+		__m128i a = load4_sse2(rgbbuff), b = load4_sse2(rgbbuff + 12); \
+		a = PACK(a, _mm_and_si128, _mm_slli_epi32, _mm_srli_epi32, _mm_or_si128, SSE_C); \
+		b = PACK(b, _mm_and_si128, _mm_slli_epi32, _mm_srli_epi32, _mm_or_si128, SSE_C); \
+		_mm_storeu_si128((__m128i *) (d + i), pack16_sse2(a, b)); \
+	} \
+	tail(d + i, rgbbuff, count - i); \
+}
+
+SSE2_CONVERT16(convert16_sse2, PACK565, convert16)
+SSE2_CONVERT16(convert15_sse2, PACK555, convert15)
+
+/* 'alpha' is ORed into every pixel */
+#define SSE2_CONVERT32(name, alpha, tail) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	unsigned int i = 0; \
+	u_int32_t *d = (u_int32_t *) dst; \
+	for(; i + 5 <= count; i += 4, rgbbuff += 12) \
+	{ \
+		__m128i a = load4_sse2(rgbbuff); \
+		a = PACK888(a, _mm_and_si128, _mm_slli_epi32, _mm_srli_epi32, _mm_or_si128, SSE_C); \
+		_mm_storeu_si128((__m128i *) (d + i), _mm_or_si128(a, SSE_C(alpha))); \
+	} \
+	tail(d + i, rgbbuff, count - i); \
+}
+
+SSE2_CONVERT32(convert32_sse2, 0, convert32)
+SSE2_CONVERT32(convert32a_sse2, 0xFF000000, convert32a)
+
+/* 32 bit stores at a 3 byte pitch; the spare byte is overwritten by the next pixel */
+#define SSE2_CONVERT24(name, PACK, tail) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	unsigned int i = 0; \
+	u_int8_t *d = (u_int8_t *) dst; \
+	for(; i + 5 <= count; i += 4, rgbbuff += 12, d += 12) \
+	{ \
+		__m128i a = load4_sse2(rgbbuff); \
+		u_int32_t v; \
+		int k; \
+		a = PACK(a, _mm_and_si128, _mm_slli_epi32, _mm_srli_epi32, _mm_or_si128, SSE_C); \
+		for(k = 0; k < 4; k++, a = _mm_srli_si128(a, 4)) \
+		{ \
+			v = _mm_cvtsi128_si32(a); \
+			memcpy(d + k * 3, &v, 4); \
+		} \
+	} \
+	tail(d, rgbbuff, count - i); \
+}
+
+SSE2_CONVERT24(convert24_sse2, PACK666, convert24)
+SSE2_CONVERT24(convert24_888_sse2, PACK888, convert24_888)
+#endif
+
+#ifdef FBV_AVX2
+#define AVX_C(v)	_mm256_set1_epi32(v)
+
+__attribute__((target("avx2")))
+static inline __m256i load8_avx2(const unsigned char *p)
+{
+	/* 8 pixels -> 8 lanes; reads 4 bytes past the eighth pixel */
+	const __m256i shuf = _mm256_setr_epi8(
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		_mm_loadu_si128((const __m128i *) p)),
+		_mm_loadu_si128((const __m128i *) (p + 12)), 1);
+	return _mm256_shuffle_epi8(v, shuf);
+}
+
+#define AVX2_CONVERT16(name, PACK, tail) \
+__attribute__((target("avx2"))) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	unsigned int i = 0; \
+	u_int16_t *d = (u_int16_t *) dst; \
+	for(; i + 10 <= count; i += 8, rgbbuff += 24) \
+	{ \
+		__m256i a = load8_avx2(rgbbuff); \
+		a = PACK(a, _mm256_and_si256, _mm256_slli_epi32, _mm256_srli_epi32, _mm256_or_si256, AVX_C); \
+		a = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, a), 0x08); \
+		_mm_storeu_si128((__m128i *) (d + i), _mm256_castsi256_si128(a)); \
+	} \
+	tail(d + i, rgbbuff, count - i); \
+}
+
+AVX2_CONVERT16(convert16_avx2, PACK565, convert16)
+AVX2_CONVERT16(convert15_avx2, PACK555, convert15)
+
+#define AVX2_CONVERT32(name, alpha, tail) \
+__attribute__((target("avx2"))) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	unsigned int i = 0; \
+	u_int32_t *d = (u_int32_t *) dst; \
+	for(; i + 10 <= count; i += 8, rgbbuff += 24) \
+	{ \
+		__m256i a = load8_avx2(rgbbuff); \
+		a = PACK888(a, _mm256_and_si256, _mm256_slli_epi32, _mm256_srli_epi32, _mm256_or_si256, AVX_C); \
+		_mm256_storeu_si256((__m256i *) (d + i), _mm256_or_si256(a, AVX_C(alpha))); \
+	} \
+	tail(d + i, rgbbuff, count - i); \
+}
+
+AVX2_CONVERT32(convert32_avx2, 0, convert32)
+AVX2_CONVERT32(convert32a_avx2, 0xFF000000, convert32a)
+
+/* each 16 byte store carries 4 spare bytes, overwritten by the next store */
+#define AVX2_CONVERT24(name, PACK, tail) \
+__attribute__((target("avx2"))) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	const __m256i shuf = _mm256_setr_epi8( \
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, \
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1); \
+	unsigned int i = 0; \
+	u_int8_t *d = (u_int8_t *) dst; \
+	for(; i + 10 <= count; i += 8, rgbbuff += 24, d += 24) \
+	{ \
+		__m256i a = load8_avx2(rgbbuff); \
+		a = PACK(a, _mm256_and_si256, _mm256_slli_epi32, _mm256_srli_epi32, _mm256_or_si256, AVX_C); \
+		a = _mm256_shuffle_epi8(a, shuf); \
+		_mm_storeu_si128((__m128i *) d, _mm256_castsi256_si128(a)); \
+		_mm_storeu_si128((__m128i *) (d + 12), _mm256_extracti128_si256(a, 1)); \
+	} \
+	tail(d, rgbbuff, count - i); \
+}
+
+AVX2_CONVERT24(convert24_avx2, PACK666, convert24)
+AVX2_CONVERT24(convert24_888_avx2, PACK888, convert24_888)
+#endif
+
+#ifdef FBV_NEON
+static void convert16_neon(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+	unsigned int i = 0;
+	u_int16_t *d = (u_int16_t *) dst;
+
+	for(; i + 16 <= count; i += 16, rgbbuff += 48)
+	{
+		uint8x16x3_t p = vld3q_u8(rgbbuff);
+		uint16x8_t lo, hi;
+
+		lo = vshll_n_u8(vget_low_u8(p.val[0]), 8);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(p.val[1]), 8), 5);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(p.val[2]), 8), 11);
+		hi = vshll_n_u8(vget_high_u8(p.val[0]), 8);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(p.val[1]), 8), 5);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(p.val[2]), 8), 11);
+		vst1q_u16(d + i, lo);
+		vst1q_u16(d + i + 8, hi);
+	}
+	convert16(d + i, rgbbuff, count - i);
+}
+
+static void convert15_neon(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+	unsigned int i = 0;
+	u_int16_t *d = (u_int16_t *) dst;
+
+	for(; i + 16 <= count; i += 16, rgbbuff += 48)
+	{
+		uint8x16x3_t p = vld3q_u8(rgbbuff);
+		uint16x8_t lo, hi;
+
+		lo = vshrq_n_u16(vshll_n_u8(vget_low_u8(p.val[0]), 8), 1);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(p.val[1]), 8), 6);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(p.val[2]), 8), 11);
+		hi = vshrq_n_u16(vshll_n_u8(vget_high_u8(p.val[0]), 8), 1);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(p.val[1]), 8), 6);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(p.val[2]), 8), 11);
+		vst1q_u16(d + i, lo);
+		vst1q_u16(d + i + 8, hi);
+	}
+	convert15(d + i, rgbbuff, count - i);
+}
+
+static void convert24_neon(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+	unsigned int i = 0;
+	u_int8_t *d = (u_int8_t *) dst;
+
+	for(; i + 16 <= count; i += 16, rgbbuff += 48, d += 48)
+	{
+		uint8x16x3_t p = vld3q_u8(rgbbuff), o;
+
+		o.val[0] = vorrq_u8(vshrq_n_u8(p.val[2], 2), vshlq_n_u8(vandq_u8(p.val[1], vdupq_n_u8(0x0C)), 4));
+		o.val[1] = vorrq_u8(vshrq_n_u8(p.val[1], 4), vshlq_n_u8(vandq_u8(p.val[0], vdupq_n_u8(0x3C)), 2));
+		o.val[2] = vshrq_n_u8(p.val[0], 6);
+		vst3q_u8(d, o);
+	}
+	convert24(d, rgbbuff, count - i);
+}
+
+static void convert24_888_neon(void *dst, const unsigned char *rgbbuff, unsigned int count)
+{
+	unsigned int i = 0;
+	u_int8_t *d = (u_int8_t *) dst;
+
+	for(; i + 16 <= count; i += 16, rgbbuff += 48, d += 48)
+	{
+		uint8x16x3_t p = vld3q_u8(rgbbuff), o;
+
+		o.val[0] = p.val[2];
+		o.val[1] = p.val[1];
+		o.val[2] = p.val[0];
+		vst3q_u8(d, o);
+	}
+	convert24_888(d, rgbbuff, count - i);
+}
+
+/* little endian only: a pixel is stored as b, g, r, alpha */
+#define NEON_CONVERT32(name, alpha, tail) \
+static void name(void *dst, const unsigned char *rgbbuff, unsigned int count) \
+{ \
+	unsigned int i = 0; \
+	u_int32_t *d = (u_int32_t *) dst; \
+	for(; i + 16 <= count; i += 16, rgbbuff += 48) \
+	{ \
+		uint8x16x3_t p = vld3q_u8(rgbbuff); \
+		uint8x16x4_t o; \
+		o.val[0] = p.val[2]; \
+		o.val[1] = p.val[1]; \
+		o.val[2] = p.val[0]; \
+		o.val[3] = vdupq_n_u8(alpha); \
+		vst4q_u8((u_int8_t *) (d + i), o); \
+	} \
+	tail(d + i, rgbbuff, count - i); \
+}
+
+NEON_CONVERT32(convert32_neon, 0, convert32)
+NEON_CONVERT32(convert32a_neon, 0xFF, convert32a)
+#endif
+
+#ifdef FBV_AVX2
+#define HAVE_AVX2()	__builtin_cpu_supports("avx2")
+#endif
+
+/* does the format have this red/green/blue layout (offset, length)? */
+static int layout(const struct fb_format *fmt, int cpp, int ro, int rl, int go, int gl, int bo, int bl)
+{
+    return fmt->cpp == cpp &&
+	fmt->red.offset == ro && fmt->red.length == rl &&
+	fmt->green.offset == go && fmt->green.length == gl &&
+	fmt->blue.offset == bo && fmt->blue.length == bl;
+}
+
+fb_convert_fn selectRGB2FB(const struct fb_format *fmt)
+{
+    fb_convert_fn f;
+
+    if(fmt->pseudocolor)
+	return convert8;
+
+    /* the fast converters leave a transp field at 0, so they only do without one */
+    if(layout(fmt, 2, 11, 5, 5, 6, 0, 5) && !fmt->transp.length)
+    {
+	f = convert16;
+#ifdef FBV_SSE2
+	f = convert16_sse2;
+#endif
+#ifdef FBV_AVX2
+	if(HAVE_AVX2()) f = convert16_avx2;
+#endif
+#ifdef FBV_NEON
+	f = convert16_neon;
+#endif
+	return f;
+    }
+    if(layout(fmt, 2, 10, 5, 5, 5, 0, 5) && !fmt->transp.length)
+    {
+	f = convert15;
+#ifdef FBV_SSE2
+	f = convert15_sse2;
+#endif
+#ifdef FBV_AVX2
+	if(HAVE_AVX2()) f = convert15_avx2;
+#endif
+#ifdef FBV_NEON
+	f = convert15_neon;
+#endif
+	return f;
+    }
+    if(layout(fmt, 3, 12, 6, 6, 6, 0, 6) && !fmt->transp.length)  /* BGR666 */
+    {
+	f = convert24;
+#ifdef FBV_SSE2
+	f = convert24_sse2;
+#endif
+#ifdef FBV_AVX2
+	if(HAVE_AVX2()) f = convert24_avx2;
+#endif
+#ifdef FBV_NEON
+	f = convert24_neon;
+#endif
+	return f;
+    }
+    if(layout(fmt, 3, 16, 8, 8, 8, 0, 8) && !fmt->transp.length)  /* RGB888 */
+    {
+	f = convert24_888;
+#ifdef FBV_SSE2
+	f = convert24_888_sse2;
+#endif
+#ifdef FBV_AVX2
+	if(HAVE_AVX2()) f = convert24_888_avx2;
+#endif
+#ifdef FBV_NEON
+	f = convert24_888_neon;
+#endif
+	return f;
+    }
+    if(layout(fmt, 4, 16, 8, 8, 8, 0, 8) && !fmt->transp.length)  /* XRGB8888 */
+    {
+	f = convert32;
+#ifdef FBV_SSE2
+	f = convert32_sse2;
+#endif
+#ifdef FBV_AVX2
+	if(HAVE_AVX2()) f = convert32_avx2;
+#endif
+#if defined(FBV_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	f = convert32_neon;
+#endif
+	return f;
+    }
+    if(layout(fmt, 4, 16, 8, 8, 8, 0, 8) && fmt->transp.offset == 24 && fmt->transp.length == 8)  /* ARGB8888 */
+    {
+	f = convert32a;
+#ifdef FBV_SSE2
+	f = convert32a_sse2;
+#endif
+#ifdef FBV_AVX2
+	if(HAVE_AVX2()) f = convert32a_avx2;
+#endif
+#if defined(FBV_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	f = convert32a_neon;
+#endif
+	return f;
+    }
+
+    setup_generic(fmt);
+    return convert_generic;
+}
+
+/*
+ * Framebuffer -> RGB. Channels are widened by repeating their top bits,
+ * so full intensity stays full intensity.
+ */
+static void unpack8(unsigned char *rgbbuff, const void *src, unsigned int count)
+{
+    const u_int8_t *c = (const u_int8_t *) src;
+    unsigned int i;
+
+    /* the levels make332map() puts in the palette */
+    for(i = 0; i < count; i++, rgbbuff += 3)
+    {
+	rgbbuff[0] = ((c[i] >> 5) & 7) * 36;
+	rgbbuff[1] = ((c[i] >> 2) & 7) * 36;
+	rgbbuff[2] = (c[i] & 3) * 85;
+    }
+}
+
+static void unpack15(unsigned char *rgbbuff, const void *src, unsigned int count)
+{
+    const u_int16_t *c = (const u_int16_t *) src;
+    unsigned int i, r, g, b;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+    {
+	r = (c[i] >> 10) & 31; g = (c[i] >> 5) & 31; b = c[i] & 31;
+	rgbbuff[0] = (r << 3) | (r >> 2);
+	rgbbuff[1] = (g << 3) | (g >> 2);
+	rgbbuff[2] = (b << 3) | (b >> 2);
+    }
+}
+
+static void unpack16(unsigned char *rgbbuff, const void *src, unsigned int count)
+{
+    const u_int16_t *c = (const u_int16_t *) src;
+    unsigned int i, r, g, b;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+    {
+	r = (c[i] >> 11) & 31; g = (c[i] >> 5) & 63; b = c[i] & 31;
+	rgbbuff[0] = (r << 3) | (r >> 2);
+	rgbbuff[1] = (g << 2) | (g >> 4);
+	rgbbuff[2] = (b << 3) | (b >> 2);
+    }
+}
+
+static void unpack24(unsigned char *rgbbuff, const void *src, unsigned int count)  /* BGR666 */
+{
+    const u_int8_t *c = (const u_int8_t *) src;
+    unsigned int i, v, r, g, b;
+
+    for(i = 0; i < count; i++, rgbbuff += 3, c += 3)
+    {
+	v = c[0] | (c[1] << 8) | (c[2] << 16);
+	r = (v >> 12) & 63; g = (v >> 6) & 63; b = v & 63;
+	rgbbuff[0] = (r << 2) | (r >> 4);
+	rgbbuff[1] = (g << 2) | (g >> 4);
+	rgbbuff[2] = (b << 2) | (b >> 4);
+    }
+}
+
+static void unpack24_888(unsigned char *rgbbuff, const void *src, unsigned int count)  /* RGB888 */
+{
+    const u_int8_t *c = (const u_int8_t *) src;
+    unsigned int i;
+
+    for(i = 0; i < count; i++, rgbbuff += 3, c += 3)
+    {
+	rgbbuff[0] = c[2];
+	rgbbuff[1] = c[1];
+	rgbbuff[2] = c[0];
+    }
+}
+
+static void unpack32(unsigned char *rgbbuff, const void *src, unsigned int count)
+{
+    const u_int32_t *c = (const u_int32_t *) src;
+    unsigned int i;
+
+    for(i = 0; i < count; i++, rgbbuff += 3)
+    {
+	rgbbuff[0] = c[i] >> 16;
+	rgbbuff[1] = c[i] >> 8;
+	rgbbuff[2] = c[i];
+    }
+}
+
+static struct
+{
+    int cpp;
+    struct fb_channel c[3];
+    unsigned char widen[3][256];
+} ungen;
+
+static void unpack_generic(unsigned char *rgbbuff, const void *src, unsigned int count)
+{
+    const u_int8_t *s = (const u_int8_t *) src;
+    unsigned int i, k, f;
+    u_int32_t v;
+
+    for(i = 0; i < count; i++, rgbbuff += 3, s += ungen.cpp)
+    {
+	switch(ungen.cpp)
+	{
+	    case 1:
+		v = s[0];
+		break;
+	    case 2:
+		v = *(const u_int16_t *) s;
+		break;
+	    case 3:
+		v = s[0] | (s[1] << 8) | (s[2] << 16);
+		break;
+	    default:
+		v = *(const u_int32_t *) s;
+	}
+	for(k = 0; k < 3; k++)
+	{
+	    f = (v >> ungen.c[k].offset) & field_mask(ungen.c[k].length);
+	    rgbbuff[k] = (ungen.c[k].length > 8) ? f >> (ungen.c[k].length - 8) : ungen.widen[k][f];
+	}
+    }
+}
+
+static void setup_ungeneric(const struct fb_format *fmt)
+{
+    int k, v, sh, len;
+
+    ungen.cpp = fmt->cpp;
+    ungen.c[0] = fmt->red;
+    ungen.c[1] = fmt->green;
+    ungen.c[2] = fmt->blue;
+    for(k = 0; k < 3; k++)
+    {
+	len = ungen.c[k].length;
+	if(len <= 0 || len > 8)
+	    continue;
+	/* repeat the field's bits down to 8 */
+	for(v = 0; v < (1 << len); v++)
+	{
+	    ungen.widen[k][v] = 0;
+	    for(sh = 8 - len; sh > -len; sh -= len)
+		ungen.widen[k][v] |= (sh >= 0) ? v << sh : v >> -sh;
+	}
+    }
+}
+
+/* transp bits are ignored on the way back, the fast unpackers do without a check */
+fb_unpack_fn selectFB2RGB(const struct fb_format *fmt)
+{
+    if(fmt->pseudocolor)
+	return unpack8;
+    if(layout(fmt, 2, 11, 5, 5, 6, 0, 5))
+	return unpack16;
+    if(layout(fmt, 2, 10, 5, 5, 5, 0, 5))
+	return unpack15;
+    if(layout(fmt, 3, 12, 6, 6, 6, 0, 6))
+	return unpack24;
+    if(layout(fmt, 3, 16, 8, 8, 8, 0, 8))
+	return unpack24_888;
+    if(layout(fmt, 4, 16, 8, 8, 8, 0, 8))
+	return unpack32;
+
+    setup_ungeneric(fmt);
+    return unpack_generic;
+}
+
+/*
+ * Source-over blending of 'n' channel bytes: d = (s * a + d * (255 - a)) / 255,
+ * rounded, with 'a' already repeated for every channel.
+ */
+static inline unsigned char blend8(unsigned int s, unsigned int d, unsigned int a)
+{
+    unsigned int t = s * a + d * (255 - a) + 128;
+
+    return (t + (t >> 8)) >> 8;
+}
+
+static void blend_bytes(unsigned char *d, const unsigned char *s, const unsigned char *a, unsigned int n)
+{
+	unsigned int i = 0;
+
+#if defined(FBV_SSE2)
+	const __m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i vs = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i vd = _mm_loadu_si128((const __m128i *) (d + i));
+		__m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+		__m128i lo, hi, al, ah;
+
+		al = _mm_unpacklo_epi8(va, zero);
+		ah = _mm_unpackhi_epi8(va, zero);
+		lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(vs, zero), al),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(vd, zero), _mm_sub_epi16(c255, al))), c128);
+		hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(vs, zero), ah),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(vd, zero), _mm_sub_epi16(c255, ah))), c128);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *) (d + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(FBV_NEON)
+	for(; i + 16 <= n; i += 16)
+	{
+		uint8x16_t vs = vld1q_u8(s + i), vd = vld1q_u8(d + i), va = vld1q_u8(a + i);
+		uint8x16_t vn = vmvnq_u8(va);
+		uint16x8_t lo, hi;
+
+		lo = vmlal_u8(vmull_u8(vget_low_u8(vs), vget_low_u8(va)), vget_low_u8(vd), vget_low_u8(vn));
+		hi = vmlal_u8(vmull_u8(vget_high_u8(vs), vget_high_u8(va)), vget_high_u8(vd), vget_high_u8(vn));
+		/* (t + 128 + ((t + 128) >> 8)) >> 8 */
+		vst1q_u8(d + i, vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)),
+			vraddhn_u16(hi, vrshrq_n_u16(hi, 8))));
+	}
+#endif
+	for(; i < n; i++)
+		d[i] = blend8(s[i], d[i], a[i]);
+}
+
+void blend_row(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, unsigned int count)
+{
+	unsigned char a3[256 * 3];
+	unsigned int i, n;
+
+	/* widen alpha to one byte per channel, a chunk at a time */
+	while(count)
+	{
+		n = min(count, 256);
+		for(i = 0; i < n; i++)
+			a3[i * 3] = a3[i * 3 + 1] = a3[i * 3 + 2] = alpha[i];
+		blend_bytes(dst, src, a3, n * 3);
+		dst += n * 3;
+		src += n * 3;
+		alpha += n;
+		count -= n;
+	}
+}
+
+/*
+ * Ordered dithering. Every channel byte is first scaled so that the
+ * converter's dropped bits land on the levels the display really has,
+ * d = (v * scale + v) >> 8, then the threshold is added, saturating.
+ * dst may be rgbbuff.
+ */
+void dither_row(unsigned char *dst, const unsigned char *rgbbuff, const unsigned char *threshold, const unsigned char *scale, unsigned int count)
+{
+	unsigned int i = 0, n = count * 3, t;
+
+#if defined(FBV_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (rgbbuff + i));
+		__m128i m = _mm_loadu_si128((const __m128i *) (scale + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+
+		lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, _mm_unpacklo_epi8(m, zero)), lo), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, _mm_unpackhi_epi8(m, zero)), hi), 8);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epu8(_mm_packus_epi16(lo, hi),
+			_mm_loadu_si128((const __m128i *) (threshold + i))));
+	}
+#elif defined(FBV_NEON)
+	for(; i + 16 <= n; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(rgbbuff + i), m = vld1q_u8(scale + i);
+		uint16x8_t lo = vaddw_u8(vmull_u8(vget_low_u8(v), vget_low_u8(m)), vget_low_u8(v));
+		uint16x8_t hi = vaddw_u8(vmull_u8(vget_high_u8(v), vget_high_u8(m)), vget_high_u8(v));
+
+		vst1q_u8(dst + i, vqaddq_u8(vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)),
+			vld1q_u8(threshold + i)));
+	}
+#endif
+	for(; i < n; i++)
+	{
+		t = ((rgbbuff[i] * scale[i] + rgbbuff[i]) >> 8) + threshold[i];
+		dst[i] = (t > 255) ? 255 : t;
+	}
+}
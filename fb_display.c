@@ -35,15 +35,33 @@
 #include <asm/types.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include "config.h"
+#include "fbv.h"
 /* Public Use Functions:
  *
- * extern void fb_display(unsigned char *rgbbuff,
+ * extern struct fb_session *fb_open(const char *name, int flags);
+ *
+ * extern void fb_close(struct fb_session *s);
+ *
+ * extern void fb_display(struct fb_session *s,
+ *     unsigned char *rgbbuff, unsigned char *alpha, int orient,
  *     int x_size, int y_size,
  *     int x_pan, int y_pan,
- *     int x_offs, int y_offs);
+ *     int x_offs, int y_offs,
+ *     const struct fb_rect *damage, struct fb_cache **cache,
+ *     unsigned char **savebuf, int save);
+ *
+ *     *cache holds the image converted to the framebuffer format, in
+ *     tiles of FB_TILE pixels square converted as they come into view.
+ *
+ * extern void fb_cache_free(struct fb_cache *c);
  *
- * extern void getCurrentRes(int *x,int *y);
+ * extern size_t fb_cache_bytes(const struct fb_cache *c);
+ *
+ * extern void getCurrentRes(struct fb_session *s, int *x, int *y);
+ *
+ * extern int fb_dump(struct fb_session *s, const char *name);
  *
  */
 
@@ -57,81 +75,896 @@ struct fb_cmap map332 = {0, 256, red, green, blue, NULL};
 unsigned short red_b[256], green_b[256], blue_b[256];
 struct fb_cmap map_back = {0, 256, red_b, green_b, blue_b, NULL};
 
+/* one frame: which part of which image goes where on the screen */
+struct fb_frame
+{
+	unsigned char *rgb, *alpha;
+	int orient;			/* quarter turns right from rgb and alpha ... */
+	int x_size, y_size;		/* ... to the image of this size */
+	int x_pan, y_pan;		/* image pixel shown top left ... */
+	int x_offs, y_offs;		/* ... at this screen position */
+	int w, h;			/* window size */
+	unsigned char *bg;		/* saved background of the window */
+	struct fb_cache *native;	/* image in the framebuffer format */
+};
+
+/*
+ * The converted image is kept in FB_TILE square tiles, each converted
+ * the first time it comes into view. Only enough tiles for a few screens
+ * are kept, so a huge image costs no more than a small one; the tile
+ * not needed for the longest makes room for a new one.
+ */
+#define FB_TILE 128
+
+struct fb_tile
+{
+	unsigned char *pixels;		/* FB_TILE lines of FB_TILE pixels, or NULL */
+	unsigned int used;		/* last blit that needed it */
+	int valid;			/* pixels are converted */
+};
+
+struct fb_cache
+{
+	int cols, rows;			/* tiles across and down */
+	int count, limit;		/* tiles holding pixels, and at most */
+	int cpp;			/* bytes per pixel in a tile */
+	unsigned int clock;
+	struct fb_tile *tile;
+};
+
+/*
+ * The framebuffer session is opened once and kept for the lifetime of
+ * the program. The device handle, the screen info and the mapping of the
+ * video memory are all set up by fb_open(), so a redraw is pixel work only.
+ */
+struct fb_session
+{
+	const struct fb_backend *be;
+	int fh;
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	unsigned char *mem;		/* mmapped video memory */
+	unsigned char *shadow;		/* a copy of it in RAM, if wanted */
+	unsigned char *draw;		/* where pixels are drawn and read back: one of the two */
+	int shadowed;
+	unsigned long mem_len;
+	unsigned int x_stride;		/* line length in pixels */
+	struct fb_format fmt;		/* pixel layout */
+	int cpp;			/* bytes per pixel */
+	fb_convert_fn convert;		/* RGB -> framebuffer row converter */
+	fb_unpack_fn unpack;		/* ... and back, for blending */
+	unsigned char *rowbuf;		/* ROWBUF_LINE bytes of scratch space per thread */
+
+	/* dithering, for formats with fewer than 8 bits a channel */
+	int dither;			/* FB_DITHER, FB_DIFFUSE */
+	unsigned char *thresholds;	/* 8 rows of the ordered pattern */
+	unsigned char *scales;		/* ... and a row of channel scales */
+
+	/*
+	 * Page flipping: with two pages every frame is drawn into the hidden
+	 * one and shown with FBIOPAN_DISPLAY, so a frame never tears.
+	 */
+	int pages;			/* 1 or 2 */
+	int back;			/* page we draw into next */
+	unsigned int page_y[2];		/* yoffset of each page */
+	unsigned int console_y;		/* yoffset we found the console at */
+	int unsynced;			/* pages not yet holding the console contents */
+	int var_changed;		/* yres_virtual was grown, restore on close */
+	struct fb_var_screeninfo orig_var;
+
+	/* vsync pacing: frames are put on screen on a vertical blank */
+	int vsync;
+	long long frame_ns;		/* refresh period */
+	unsigned int presents;		/* frames presented on a vblank */
+	unsigned int missed;		/* ... of which missed their vblank */
+	long long last_vblank;		/* when the last one waited for came */
+
+	/* hardware panning: a large image is put into the virtual screen whole */
+	int hwpan;			/* allowed */
+	int hw_active;			/* an image is up there now */
+
+	/* the last frame shown, partial updates start from it */
+	int shown;
+	struct fb_frame last;
+	struct fb_rect stale;		/* window area the back page is behind on */
+};
+
 
 int openFB(const char *name);
 void closeFB(int fh);
-void getVarScreenInfo(int fh, struct fb_var_screeninfo *var);
-void setVarScreenInfo(int fh, struct fb_var_screeninfo *var);
-void getFixScreenInfo(int fh, struct fb_fix_screeninfo *fix);
-void set332map(int fh);
-void* convertRGB2FB(int fh, unsigned char *rgbbuff, unsigned long count, int bpp, int *cpp);
-void blit2FB(int fh, void *fbbuff, unsigned char *alpha,
-	unsigned int pic_xs, unsigned int pic_ys,
-	unsigned int scr_xs, unsigned int scr_ys,
-	unsigned int xp, unsigned int yp,
-	unsigned int xoffs, unsigned int yoffs,
-	int cpp,
-	unsigned char **savebuf, int save);
-
-void fb_display(unsigned char *rgbbuff, unsigned char * alpha, int x_size, int y_size, int x_pan, int y_pan, int x_offs, int y_offs, unsigned char **savebuf, int save)
-{
-    struct fb_var_screeninfo var;
-    struct fb_fix_screeninfo fix;
-    unsigned short *fbbuff = NULL;
-    int fh = -1, bp = 0;
-    unsigned long x_stride;
-    
-    /* get the framebuffer device handle */
-    fh = openFB(NULL);
-    
-    /* read current video mode */
-    getVarScreenInfo(fh, &var);
-    getFixScreenInfo(fh, &fix);
-    
-    x_stride = (fix.line_length * 8) / var.bits_per_pixel;
-   
+static int ioctlFB(int fh, unsigned long req, void *arg);
+
+/* a real framebuffer device */
+static const struct fb_backend fb_device = { openFB, closeFB, ioctlFB };
+
+void getVarScreenInfo(struct fb_session *s, struct fb_var_screeninfo *var);
+void setVarScreenInfo(struct fb_session *s, struct fb_var_screeninfo *var);
+void getFixScreenInfo(struct fb_session *s, struct fb_fix_screeninfo *fix);
+void set332map(struct fb_session *s);
+void get8map(struct fb_session *s, struct fb_cmap *map);
+void set8map(struct fb_session *s, struct fb_cmap *map);
+static void save_background(struct fb_session *s, unsigned int page_y, const struct fb_frame *f, unsigned char **savebuf);
+static int rect_empty(const struct fb_rect *r);
+static struct fb_rect rect_window(const struct fb_frame *f, const struct fb_rect *r);
+static struct fb_rect rect_union(struct fb_rect a, struct fb_rect b);
+static void draw_frame(struct fb_session *s, unsigned int page_y, unsigned int src_y, const struct fb_frame *f, const struct fb_rect *dirty, int dx, int dy);
+static struct fb_cache *cache_new(struct fb_session *s, int x_size, int y_size);
+static void cache_damage(struct fb_cache *c, const struct fb_rect *r);
+static void diffuse_image(struct fb_session *s, const struct fb_frame *f);
+static void blit2FB(struct fb_session *s, unsigned int page_y, const struct fb_frame *f, const struct fb_rect *r);
+static void map_screen(struct fb_session *s);
+static void push(struct fb_session *s, const unsigned char *p, unsigned long len);
+static void clear_screen(struct fb_session *s, unsigned long off, unsigned long len);
+static int wait_vsync(struct fb_session *s);
+
+static void set_channel(struct fb_channel *c, const struct fb_bitfield *b)
+{
+	c->offset = b->offset;
+	c->length = b->length;
+}
+
+/* the pixel layout, drivers that leave the bitfields empty get the old fixed ones */
+static void get_format(struct fb_session *s)
+{
+	struct fb_format *f = &s->fmt;
+	static const struct fb_format legacy[] = {
+		{ 15, 2, 0, { 10, 5 }, { 5, 5 }, { 0, 5 }, { 0, 0 } },
+		{ 16, 2, 0, { 11, 5 }, { 5, 6 }, { 0, 5 }, { 0, 0 } },
+		{ 24, 3, 0, { 12, 6 }, { 6, 6 }, { 0, 6 }, { 0, 0 } },	/* BGR666 */
+		{ 32, 4, 0, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 0, 0 } },
+	};
+	unsigned int i;
+
+	memset(f, 0, sizeof(*f));
+	f->bpp = s->var.bits_per_pixel;
+	switch(f->bpp)
+	{
+		case 8:
+			f->cpp = 1;
+			break;
+		case 15:
+		case 16:
+			f->cpp = 2;
+			break;
+		case 24:
+			f->cpp = 3;
+			break;
+		case 32:
+			f->cpp = 4;
+			break;
+		default:
+			fprintf(stderr, "Unsupported video mode! You've got: %dbpp\n", f->bpp);
+			exit(1);
+	}
+	s->cpp = f->cpp;
+
+	if(s->fix.visual == FB_VISUAL_PSEUDOCOLOR)
+	{
+		if(f->cpp != 1)
+		{
+			fprintf(stderr, "Unsupported video mode! You've got: %dbpp with a palette\n", f->bpp);
+			exit(1);
+		}
+		f->pseudocolor = 1;
+		return;
+	}
+
+	set_channel(&f->red, &s->var.red);
+	set_channel(&f->green, &s->var.green);
+	set_channel(&f->blue, &s->var.blue);
+	set_channel(&f->transp, &s->var.transp);
+	if(f->red.length || f->green.length || f->blue.length)
+		return;
+
+	if(f->cpp == 1)
+	{
+		f->pseudocolor = 1;
+		return;
+	}
+	for(i = 0; i < sizeof(legacy) / sizeof(legacy[0]); i++)
+		if(legacy[i].bpp == f->bpp)
+			*f = legacy[i];
+}
+
+#define DITHER_SPAN	256	/* pixels dithered at a time */
+
+/*
+ * The 8x8 Bayer matrix scaled to each channel's lost low bits and laid
+ * out as RGB rows, long enough that a span can start at any column.
+ * A channel kept to 'len' bits shows levels 255 / (2^len - 1) apart (or
+ * those of the 332 palette) rather than 2^(8 - len), values are scaled
+ * to match first so the pattern averages out to the value asked for.
+ */
+static void setup_dither(struct fb_session *s, int flags)
+{
+	static const unsigned char bayer[8][8] = {
+		{  0, 32,  8, 40,  2, 34, 10, 42 },
+		{ 48, 16, 56, 24, 50, 18, 58, 26 },
+		{ 12, 44,  4, 36, 14, 46,  6, 38 },
+		{ 60, 28, 52, 20, 62, 30, 54, 22 },
+		{  3, 35, 11, 43,  1, 33,  9, 41 },
+		{ 51, 19, 59, 27, 49, 17, 57, 25 },
+		{ 15, 47,  7, 39, 13, 45,  5, 37 },
+		{ 63, 31, 55, 23, 61, 29, 53, 21 },
+	};
+	int len[3], step[3], scale[3], x, y, k;
+
+	if(s->fmt.pseudocolor)
+	{
+		len[0] = len[1] = 3;
+		len[2] = 2;
+	}
+	else
+	{
+		len[0] = s->fmt.red.length;
+		len[1] = s->fmt.green.length;
+		len[2] = s->fmt.blue.length;
+	}
+	for(k = 0; k < 3; k++)
+	{
+		if(len[k] <= 0 || len[k] >= 8)
+		{
+			step[k] = 1;
+			scale[k] = 256;
+			continue;
+		}
+		step[k] = 1 << (8 - len[k]);
+		if(s->fmt.pseudocolor)
+		{
+			/* the levels make332map() puts in the palette */
+			int gap = (len[k] == 3) ? 36 : 85;
+
+			scale[k] = (step[k] * 256 + gap / 2) / gap;
+		}
+		else
+			scale[k] = (step[k] * 256 * ((1 << len[k]) - 1) + 127) / 255;
+	}
+	if(step[0] == 1 && step[1] == 1 && step[2] == 1)
+		return;
+
+	if(!(s->thresholds = (unsigned char *) malloc((8 * (DITHER_SPAN + 8) + DITHER_SPAN) * 3)))
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	s->scales = s->thresholds + 8 * (DITHER_SPAN + 8) * 3;
+	for(y = 0; y < 8; y++)
+		for(x = 0; x < DITHER_SPAN + 8; x++)
+			for(k = 0; k < 3; k++)
+				s->thresholds[(y * (DITHER_SPAN + 8) + x) * 3 + k] = bayer[y][x & 7] * step[k] / 64;
+	/* dither_row() multiplies by scale + 1, in 1/256ths */
+	for(x = 0; x < DITHER_SPAN; x++)
+		for(k = 0; k < 3; k++)
+			s->scales[x * 3 + k] = min(256, scale[k]) - 1;
+	s->dither = flags & (FB_DITHER | FB_DIFFUSE);
+}
+
+static void setup_hwpan(struct fb_session *s)
+{
+	if(!s->fix.xpanstep && !s->fix.ypanstep)
+	{
+		if (debugme) fprintf(stderr, "the device can not pan, hardware panning disabled\n");
+		return;
+	}
+	s->hwpan = 1;
+}
+
+/* make the virtual screen at least w x h, returns 0 if the driver will not */
+static int grow_virtual(struct fb_session *s, unsigned int w, unsigned int h)
+{
+	struct fb_var_screeninfo var;
+
+	if(s->var.xres_virtual >= w && s->var.yres_virtual >= h)
+		return 1;
+
+	var = s->var;
+	var.xres_virtual = max(w, var.xres_virtual);
+	var.yres_virtual = max(h, var.yres_virtual);
+	var.xoffset = 0;
+	var.yoffset = 0;
+	if(s->be->ioctl(s->fh, FBIOPUT_VSCREENINFO, &var))
+		return 0;
+
+	s->var_changed = 1;
+	getVarScreenInfo(s, &s->var);
+	getFixScreenInfo(s, &s->fix);
+	map_screen(s);
+
+	return s->var.xres_virtual >= w && s->var.yres_virtual >= h &&
+		(!s->fix.smem_len || s->fix.smem_len >= s->fix.line_length * s->var.yres_virtual);
+}
+
+/*
+ * back to drawing into the visible screen: show the console page, blank;
+ * a virtual screen made wider for the image goes back to its old width
+ */
+static void hw_leave(struct fb_session *s)
+{
+	struct fb_var_screeninfo var;
+
+	s->hw_active = 0;
+	s->shown = 0;
+	if(s->var.xoffset || s->var.yoffset != s->console_y)
+	{
+		s->var.xoffset = 0;
+		s->var.yoffset = s->console_y;
+		s->be->ioctl(s->fh, FBIOPAN_DISPLAY, &s->var);
+	}
+	if(s->var.xres_virtual > s->orig_var.xres_virtual)
+	{
+		var = s->var;
+		var.xres_virtual = s->orig_var.xres_virtual;
+		if(s->be->ioctl(s->fh, FBIOPUT_VSCREENINFO, &var) == 0)
+		{
+			getVarScreenInfo(s, &s->var);
+			getFixScreenInfo(s, &s->fix);
+			map_screen(s);
+		}
+	}
+	clear_screen(s, s->console_y * s->fix.line_length, s->var.yres * s->fix.line_length);
+	if(s->pages == 2)
+		s->unsynced = 3;
+}
+
+/*
+ * Hardware panning: the image is converted into the virtual screen once
+ * (and again only where it is damaged) and a pan just moves the display
+ * offset, no pixel is copied. Offsets are rounded down to the pan steps.
+ * Returns 0 if the frame is on screen, -1 to draw it the usual way.
+ */
+static int hw_display(struct fb_session *s, const struct fb_frame *f, int x_pan, int y_pan, const struct fb_rect *damage, int save)
+{
+	struct fb_var_screeninfo var;
+	struct fb_frame up;
+	struct fb_rect r;
+	int x_big = f->x_size > s->var.xres, y_big = f->y_size > s->var.yres;
+
+	if((x_big && !s->fix.xpanstep) || (y_big && !s->fix.ypanstep))
+		return -1;
+	if(!grow_virtual(s, max(f->x_size, s->var.xres), max(f->y_size, s->var.yres)))
+	{
+		if (debugme) fprintf(stderr, "no room in the virtual screen, hardware panning disabled\n");
+		s->hwpan = 0;
+		return -1;
+	}
+
+	/* the whole image, centred in the direction it fits the screen */
+	up = *f;
+	up.x_pan = up.y_pan = 0;
+	up.x_offs = x_big ? 0 : f->x_offs;
+	up.y_offs = y_big ? 0 : f->y_offs;
+	up.w = f->x_size;
+	up.h = f->y_size;
+	up.bg = NULL;
+
+	if(save || !damage || !s->hw_active)
+	{
+		clear_screen(s, 0, s->mem_len);
+		r.x = r.y = 0;
+		r.w = up.w;
+		r.h = up.h;
+		blit2FB(s, 0, &up, &r);
+	}
+	else if(!rect_empty(damage))
+	{
+		r.x = max(damage->x, 0);
+		r.y = max(damage->y, 0);
+		r.w = min(damage->x + damage->w, up.w) - r.x;
+		r.h = min(damage->y + damage->h, up.h) - r.y;
+		if(!rect_empty(&r))
+			blit2FB(s, 0, &up, &r);
+	}
+	s->hw_active = 1;
+	s->shown = 0;
+
+	var = s->var;
+	var.xoffset = x_big ? min(x_pan, f->x_size - (int) s->var.xres) : 0;
+	var.yoffset = y_big ? min(y_pan, f->y_size - (int) s->var.yres) : 0;
+	if(s->fix.xpanstep)
+		var.xoffset -= var.xoffset % s->fix.xpanstep;
+	if(s->fix.ypanstep)
+		var.yoffset -= var.yoffset % s->fix.ypanstep;
+	if(var.xoffset == s->var.xoffset && var.yoffset == s->var.yoffset)
+		return 0;
+
+	if(s->vsync)
+		wait_vsync(s);
+	if(s->be->ioctl(s->fh, FBIOPAN_DISPLAY, &var))
+	{
+		if (debugme) fprintf(stderr, "FBIOPAN_DISPLAY failed, hardware panning disabled\n");
+		s->hwpan = 0;
+		hw_leave(s);
+		return -1;
+	}
+	s->var.xoffset = var.xoffset;
+	s->var.yoffset = var.yoffset;
+	return 0;
+}
+
+static void setup_pages(struct fb_session *s)
+{
+	struct fb_var_screeninfo var;
+
+	if(s->var.yres_virtual < 2 * s->var.yres)
+	{
+		/* try to make room for a second page */
+		var = s->var;
+		var.yres_virtual = 2 * s->var.yres;
+		var.yoffset = 0;
+		if(s->be->ioctl(s->fh, FBIOPUT_VSCREENINFO, &var) == 0)
+		{
+			s->var_changed = 1;
+			getVarScreenInfo(s, &s->var);
+			getFixScreenInfo(s, &s->fix);
+			s->console_y = s->var.yoffset;
+		}
+	}
+
+	if(s->var.yres_virtual < 2 * s->var.yres || !s->fix.ypanstep ||
+	   (s->fix.smem_len && s->fix.smem_len < s->fix.line_length * 2 * s->var.yres))
+	{
+		if (debugme) fprintf(stderr, "page flipping not available, using a single buffer\n");
+		return;
+	}
+
+	s->pages = 2;
+	s->page_y[0] = 0;
+	s->page_y[1] = s->var.yres;
+	s->back = (s->console_y == s->page_y[1]) ? 0 : 1;
+}
+
+static void sync_page(struct fb_session *s, int page)
+{
+	if(s->page_y[page] != s->console_y)
+	{
+		memcpy(s->draw + s->page_y[page] * s->fix.line_length,
+		       s->draw + s->console_y * s->fix.line_length,
+		       s->var.yres * s->fix.line_length);
+		push(s, s->draw + s->page_y[page] * s->fix.line_length, s->var.yres * s->fix.line_length);
+	}
+	s->unsynced &= ~(1 << page);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int wait_vsync(struct fb_session *s)
+{
+	__u32 crtc = 0;
+
+	return s->be->ioctl(s->fh, FBIO_WAITFORVSYNC, &crtc);
+}
+
+static void setup_vsync(struct fb_session *s)
+{
+	struct fb_var_screeninfo *v = &s->var;
+	long long t0, t1, t2;
+
+	if(wait_vsync(s))
+	{
+		if (debugme) fprintf(stderr, "FBIO_WAITFORVSYNC not supported, vsync disabled\n");
+		return;
+	}
+	s->vsync = 1;
+	s->last_vblank = now_ns();
+
+	/* refresh period from the mode timings, or measured if there are none */
+	if(v->pixclock)
+		s->frame_ns = (long long) v->pixclock *
+			(v->left_margin + v->xres + v->right_margin + v->hsync_len) *
+			(v->upper_margin + v->yres + v->lower_margin + v->vsync_len) / 1000;
+	else
+	{
+		t0 = now_ns(); wait_vsync(s);
+		t1 = now_ns(); wait_vsync(s);
+		t2 = now_ns();
+		s->frame_ns = min(t1 - t0, t2 - t1);
+		s->last_vblank = t2;
+	}
+	if (debugme) fprintf(stderr, "vsync: refresh period %lld us\n", s->frame_ns / 1000);
+}
+
+/* start is when drawing the frame on the back page began */
+static int flip_pages(struct fb_session *s, long long start)
+{
+	struct fb_var_screeninfo var = s->var;
+	long long ready = now_ns(), deadline = 0;
+
+	/*
+	 * The frame had to be ready for the vblank after the last one before
+	 * it was begun; a wait since then was the caller's, not ours.
+	 */
+	if(s->vsync && s->frame_ns > 0)
+		deadline = s->last_vblank + (start - s->last_vblank) / s->frame_ns * s->frame_ns + s->frame_ns;
+
+	var.xoffset = 0;
+	var.yoffset = s->page_y[s->back];
+	if(s->be->ioctl(s->fh, FBIOPAN_DISPLAY, &var))
+		return -1;
+	s->var.yoffset = var.yoffset;
+	s->back ^= 1;
+
+	/*
+	 * The pan is latched on the next vblank. Wait for it, so we never draw
+	 * into the page still being scanned out.
+	 */
+	if(s->vsync)
+	{
+		wait_vsync(s);
+		s->last_vblank = now_ns();
+		s->presents++;
+		if(ready > deadline)
+			s->missed++;
+	}
+	return 0;
+}
+
+#define TURN_ROWS 16			/* rows of a frame turned a quarter gathered at once */
+
+/* a line to blend in, TURN_ROWS lines of turned RGB and as many of turned alpha */
+#define ROWBUF_LINE(s) ((s)->x_stride * (3 + 4 * TURN_ROWS))
+
+/* (re)map the video memory after the mode was read or changed */
+static void map_screen(struct fb_session *s)
+{
+	if(s->mem)
+		munmap(s->mem, s->mem_len);
+
+	s->x_stride = s->fix.line_length / s->cpp;
+	free(s->rowbuf);
+	if(!(s->rowbuf = (unsigned char *) malloc(ROWBUF_LINE(s) * threads_count())))
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	s->mem_len = s->fix.line_length * s->var.yres_virtual;
+
+	s->mem = mmap(NULL, s->mem_len, PROT_WRITE | PROT_READ, MAP_SHARED, s->fh, 0);
+	if(s->mem == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+
+	/* the only read of the video memory, everything later is drawn by us */
+	free(s->shadow);
+	s->shadow = NULL;
+	if(s->shadowed)
+	{
+		if((s->shadow = (unsigned char *) malloc(s->mem_len)))
+			memcpy(s->shadow, s->mem, s->mem_len);
+		else
+		{
+			if (debugme) fprintf(stderr, "no memory for the shadow framebuffer\n");
+			s->shadowed = 0;
+		}
+	}
+	s->draw = s->shadow ? s->shadow : s->mem;
+}
+
+/* copy len bytes drawn at p out to the device, when drawing into the shadow */
+static void push(struct fb_session *s, const unsigned char *p, unsigned long len)
+{
+	if(s->shadow)
+		memcpy(s->mem + (p - s->shadow), p, len);
+}
+
+static void clear_screen(struct fb_session *s, unsigned long off, unsigned long len)
+{
+	memset(s->draw + off, 0, len);
+	push(s, s->draw + off, len);
+}
+
+struct fb_session *fb_open(const char *name, int flags)
+{
+	struct fb_session *s;
+
+	if(!(s = (struct fb_session *) calloc(1, sizeof(struct fb_session))))
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	/* get the framebuffer device handle */
+	if(name == NULL)
+	{
+		name = getenv("FRAMEBUFFER");
+		if(name == NULL)
+			name = DEFAULT_FRAMEBUFFER;
+	}
+	if(!strncmp(name, "offscreen:", 10))
+	{
+		s->be = &fb_offscreen;
+		name += 10;
+	}
+	else
+		s->be = &fb_device;
+	s->fh = s->be->open(name);
+
+	/* read current video mode */
+	getVarScreenInfo(s, &s->var);
+	getFixScreenInfo(s, &s->fix);
+	s->orig_var = s->var;
+	s->console_y = s->var.yoffset;
+	s->pages = 1;
+
+	/* both move the display around the virtual screen, panning wins */
+	if(flags & FB_HWPAN)
+		setup_hwpan(s);
+	else if(flags & FB_DOUBLEBUF)
+		setup_pages(s);
+	if(flags & FB_VSYNC)
+		setup_vsync(s);
+
+	get_format(s);
+	s->convert = selectRGB2FB(&s->fmt);
+	s->unpack = selectFB2RGB(&s->fmt);
+	if(flags & FB_DITHER)
+		setup_dither(s, flags);
+
+	s->shadowed = (flags & FB_SHADOW) != 0;
+	map_screen(s);
+
+	/* the 332 palette stays in place while we own the display */
+	if(s->fmt.pseudocolor)
+	{
+		get8map(s, &map_back);
+		set332map(s);
+	}
+
+	return s;
+}
+
+void fb_close(struct fb_session *s)
+{
+	if(!s)
+		return;
+
+	if(s->vsync && s->presents)
+		fprintf(stderr, "vsync: %u of %u frames missed their vblank\n", s->missed, s->presents);
+
+	if(s->fmt.pseudocolor)
+		set8map(s, &map_back);
+
+	if(s->var_changed)
+	{
+		/* the old mode may lay lines out differently, carry the last frame over */
+		unsigned int len = s->var.xres * s->cpp, y;
+		unsigned char *keep = (unsigned char *) malloc(len * s->var.yres);
+
+		if(keep)
+			for(y = 0; y < s->var.yres; y++)
+				memcpy(keep + y * len, s->draw + (s->var.yoffset + y) * s->fix.line_length +
+				       s->var.xoffset * s->cpp, len);
+		s->shadowed = 0;
+		s->be->ioctl(s->fh, FBIOPUT_VSCREENINFO, &s->orig_var);
+		getVarScreenInfo(s, &s->var);
+		getFixScreenInfo(s, &s->fix);
+		map_screen(s);
+		if(keep)
+		{
+			for(y = 0; y < s->var.yres; y++)
+				memcpy(s->mem + (s->var.yoffset + y) * s->fix.line_length +
+				       s->var.xoffset * s->cpp, keep + y * len, len);
+			free(keep);
+		}
+	}
+	else if(s->var.yoffset != s->console_y)
+	{
+		/* leave the last frame on the console page */
+		memcpy(s->mem + s->console_y * s->fix.line_length,
+		       s->draw + s->var.yoffset * s->fix.line_length,
+		       s->var.yres * s->fix.line_length);
+		s->var.yoffset = s->console_y;
+		s->be->ioctl(s->fh, FBIOPAN_DISPLAY, &s->var);
+	}
+
+	munmap(s->mem, s->mem_len);
+	s->be->close(s->fh);
+	free(s->shadow);
+	free(s->rowbuf);
+	free(s->thresholds);
+	free(s);
+}
+
+void fb_display(struct fb_session *s, unsigned char *rgbbuff, unsigned char * alpha, int orient, int x_size, int y_size, int x_pan, int y_pan, int x_offs, int y_offs, const struct fb_rect *damage, struct fb_cache **cache, unsigned char **savebuf, int save)
+{
+    unsigned long xres = s->var.xres;
+    struct fb_frame f;
+    struct fb_rect dirty, fresh, *dp = NULL;
+    int dx = 0, dy = 0, hw_x_pan = x_pan, hw_y_pan = y_pan;
+
     /* correct panning */
-    if(x_pan > x_size - x_stride) x_pan = 0;
-    if(y_pan > y_size - var.yres) y_pan = 0;
+    if(x_pan > x_size - xres) x_pan = 0;
+    if(y_pan > y_size - s->var.yres) y_pan = 0;
     /* correct offset */
-    if(x_offs + x_size > x_stride) x_offs = 0;
-    if(y_offs + y_size > var.yres) y_offs = 0;
-    
-    /* blit buffer 2 fb */
-    fbbuff = convertRGB2FB(fh, rgbbuff, x_size * y_size, var.bits_per_pixel, &bp);
-#if 0
-    blit2FB(fh, fbbuff, alpha, x_size, y_size, x_stride, var.yres, x_pan, y_pan, x_offs, y_offs, bp);
-#else
-    blit2FB(fh, fbbuff, alpha, x_size, y_size, x_stride, var.yres_virtual, x_pan, y_pan, x_offs, y_offs + var.yoffset, bp, savebuf, save);
-#endif
-    free(fbbuff);
-   
-    /* close device */
-    closeFB(fh);
+    if(x_offs + x_size > xres) x_offs = 0;
+    if(y_offs + y_size > s->var.yres) y_offs = 0;
+
+    f.rgb = rgbbuff;
+    f.alpha = alpha;
+    f.orient = orient & 3;
+    f.x_size = x_size;
+    f.y_size = y_size;
+    f.x_pan = x_pan;
+    f.y_pan = y_pan;
+    f.x_offs = x_offs;
+    f.y_offs = y_offs;
+    f.w = min(x_size, xres);
+    f.h = min(y_size, s->var.yres);
+    f.bg = (savebuf && !save) ? *savebuf : NULL;
+    f.native = NULL;
+
+    /* the converted copy of the image, its damaged tiles have to be redone */
+    if(cache)
+    {
+	if(!*cache)
+	    *cache = cache_new(s, x_size, y_size);
+	if(*cache)
+	{
+	    f.native = *cache;
+	    if(damage && !rect_empty(damage))
+	    {
+		struct fb_rect d = *damage;
+
+		/* diffused errors travel down to the bottom of the image */
+		if(s->dither & FB_DIFFUSE)
+		{
+		    d.x = 0;
+		    d.w = x_size;
+		    d.h = y_size - d.y;
+		}
+		cache_damage(f.native, &d);
+	    }
+	    if((s->dither & FB_DIFFUSE) && !f.native->tile[f.native->cols * f.native->rows - 1].valid)
+		diffuse_image(s, &f);
+	}
+    }
+
+    /* translucent images need what is under them, those are drawn as usual */
+    if(s->hwpan && !alpha && (x_size > s->var.xres || y_size > s->var.yres))
+    {
+	if(hw_display(s, &f, hw_x_pan, hw_y_pan, damage, save) == 0)
+	    return;
+    }
+    else if(s->hw_active)
+	hw_leave(s);
+
+    /*
+     * Only what changed since the last frame is drawn: the damaged part
+     * of the image and, after a pan, the strips that scrolled into view.
+     * Translucent pixels sit on a background that does not scroll along,
+     * so those windows are always drawn in full when panned.
+     */
+    if(damage && !save && s->shown && x_size == s->last.x_size && y_size == s->last.y_size &&
+       x_offs == s->last.x_offs && y_offs == s->last.y_offs)
+    {
+	dx = x_pan - s->last.x_pan;
+	dy = y_pan - s->last.y_pan;
+	if((dx || dy) && (alpha || abs(dx) >= f.w || abs(dy) >= f.h))
+	    dx = dy = 0;
+	else
+	{
+	    dirty = rect_window(&f, damage);
+	    dp = &dirty;
+	}
+    }
+
+    if(s->pages == 2)
+    {
+	long long start = now_ns();
+
+	/* a new image starts over from what the console shows */
+	if(save)
+	    s->unsynced = 3;
+	if(s->unsynced & (1 << s->back))
+	{
+	    sync_page(s, s->back);
+	    dp = NULL;
+	    dx = dy = 0;
+	}
+	if(save && savebuf)
+	{
+	    save_background(s, s->page_y[s->back], &f, savebuf);
+	    f.bg = *savebuf;
+	}
+
+	/* the back page still holds the frame before last */
+	fresh = dirty;
+	if(dp && !dx && !dy)
+	    dirty = rect_union(dirty, s->stale);
+	draw_frame(s, s->page_y[s->back], s->page_y[s->back ^ 1], &f, dp, dx, dy);
+	if(!dp || dx || dy)
+	{
+	    fresh.x = fresh.y = 0;
+	    fresh.w = f.w;
+	    fresh.h = f.h;
+	}
+	s->stale = fresh;
+
+	if(flip_pages(s, start) == 0)
+	{
+	    s->last = f;
+	    s->shown = 1;
+	    return;
+	}
+
+	/* the device would not pan, stay on the visible page from now on */
+	if (debugme) fprintf(stderr, "FBIOPAN_DISPLAY failed, using a single buffer\n");
+	s->pages = 1;
+	save = 0;
+	dp = NULL;
+	dx = dy = 0;
+    }
+
+    if(save && savebuf)
+    {
+	save_background(s, s->var.yoffset, &f, savebuf);
+	f.bg = *savebuf;
+    }
+
+    if(s->vsync)
+    {
+	/* race the beam: the frame is late if it is still being drawn a refresh later */
+	long long t;
+
+	wait_vsync(s);
+	s->last_vblank = t = now_ns();
+	draw_frame(s, s->var.yoffset, s->var.yoffset, &f, dp, dx, dy);
+	s->presents++;
+	if(now_ns() - t > s->frame_ns)
+	    s->missed++;
+    }
+    else
+	/* convert and blit the changed part of the buffer 2 fb */
+	draw_frame(s, s->var.yoffset, s->var.yoffset, &f, dp, dx, dy);
+
+    s->last = f;
+    s->shown = 1;
 }
 
-void getCurrentRes(int *x, int *y)
+void getCurrentRes(struct fb_session *s, int *x, int *y)
 {
-    struct fb_var_screeninfo var;
-    int fh = -1;
-    fh = openFB(NULL);
-    getVarScreenInfo(fh, &var);
-    *x = var.xres;
-    *y = var.yres;
-    closeFB(fh);
+    *x = s->var.xres;
+    *y = s->var.yres;
 }
 
+/* write what is on screen to a PPM file, returns -1 if it could not */
+int fb_dump(struct fb_session *s, const char *name)
+{
+    FILE *fp;
+    unsigned char *line;
+    unsigned int y;
+    int err;
+
+    if(!(fp = fopen(name, "wb")))
+	return -1;
+    if(!(line = (unsigned char *) malloc(s->var.xres * 3)))
+    {
+	fclose(fp);
+	return -1;
+    }
+    fprintf(fp, "P6\n%u %u\n255\n", s->var.xres, s->var.yres);
+    for(y = 0; y < s->var.yres; y++)
+    {
+	s->unpack(line, s->draw + (s->var.yoffset + y) * s->fix.line_length + s->var.xoffset * s->cpp, s->var.xres);
+	fwrite(line, 3, s->var.xres, fp);
+    }
+    free(line);
+    err = ferror(fp);
+    return (fclose(fp) || err) ? -1 : 0;
+}
+
+/* the device backend, a name is a device node */
 int openFB(const char *name)
 {
     int fh;
-    char *dev;
 
-    if(name == NULL){
-	dev = getenv("FRAMEBUFFER");
-	if(dev) name = dev;
-	else name = DEFAULT_FRAMEBUFFER;
-    }
-    
     if ((fh = open(name, O_RDWR)) == -1){
         fprintf(stderr, "open %s: %s\n", name, strerror(errno));
 	exit(1);
@@ -144,25 +977,30 @@ void closeFB(int fh)
     close(fh);
 }
 
-void getVarScreenInfo(int fh, struct fb_var_screeninfo *var)
+static int ioctlFB(int fh, unsigned long req, void *arg)
 {
-    if (ioctl(fh, FBIOGET_VSCREENINFO, var)){
+    return ioctl(fh, req, arg);
+}
+
+void getVarScreenInfo(struct fb_session *s, struct fb_var_screeninfo *var)
+{
+    if (s->be->ioctl(s->fh, FBIOGET_VSCREENINFO, var)){
         fprintf(stderr, "ioctl FBIOGET_VSCREENINFO: %s\n", strerror(errno));
 	exit(1);
     }
 }
 
-void setVarScreenInfo(int fh, struct fb_var_screeninfo *var)
+void setVarScreenInfo(struct fb_session *s, struct fb_var_screeninfo *var)
 {
-    if (ioctl(fh, FBIOPUT_VSCREENINFO, var)){
+    if (s->be->ioctl(s->fh, FBIOPUT_VSCREENINFO, var)){
         fprintf(stderr, "ioctl FBIOPUT_VSCREENINFO: %s\n", strerror(errno));
 	exit(1);
     }
 }
 
-void getFixScreenInfo(int fh, struct fb_fix_screeninfo *fix)
+void getFixScreenInfo(struct fb_session *s, struct fb_fix_screeninfo *fix)
 {
-    if (ioctl(fh, FBIOGET_FSCREENINFO, fix)){
+    if (s->be->ioctl(s->fh, FBIOGET_FSCREENINFO, fix)){
         fprintf(stderr, "ioctl FBIOGET_FSCREENINFO: %s\n", strerror(errno));
 	exit(1);
     }
@@ -188,230 +1026,731 @@ void make332map(struct fb_cmap *map)
 	}
 }
 
-void set8map(int fh, struct fb_cmap *map)
+void set8map(struct fb_session *s, struct fb_cmap *map)
 {
-    if (ioctl(fh, FBIOPUTCMAP, map) < 0) {
+    if (s->be->ioctl(s->fh, FBIOPUTCMAP, map) < 0) {
         fprintf(stderr, "Error putting colormap");
         exit(1);
     }
 }
 
-void get8map(int fh, struct fb_cmap *map)
+void get8map(struct fb_session *s, struct fb_cmap *map)
 {
-    if (ioctl(fh, FBIOGETCMAP, map) < 0) {
+    if (s->be->ioctl(s->fh, FBIOGETCMAP, map) < 0) {
         fprintf(stderr, "Error getting colormap");
         exit(1);
     }
 }
 
-void set332map(int fh)
+void set332map(struct fb_session *s)
 {
     make332map(&map332);
-    set8map(fh, &map332);
+    set8map(s, &map332);
+}
+
+#define ALPHA_CLEAR	0
+#define ALPHA_BLEND	1
+#define ALPHA_OPAQUE	2
+
+static inline int alpha_class(unsigned char a)
+{
+	return (a == 0x00) ? ALPHA_CLEAR : (a == 0xff) ? ALPHA_OPAQUE : ALPHA_BLEND;
 }
 
-void blit2FB(int fh, void *fbbuff, unsigned char *alpha,
-	unsigned int pic_xs, unsigned int pic_ys,
-	unsigned int scr_xs, unsigned int scr_ys,
-	unsigned int xp, unsigned int yp,
-	unsigned int xoffs, unsigned int yoffs,
-	int cpp,
-	unsigned char **savebuf, int save)
+/* convert count pixels that sit at (x, y) in the image, dithered if asked for */
+static void convert_row(struct fb_session *s, unsigned char *dst, const unsigned char *rgbbuff, unsigned int count, int x, int y)
 {
-    int i, xc, yc;
-	unsigned char *fb;
-	
-	unsigned char *fbptr;
-	unsigned char *imptr;
-	unsigned char *saveptr=NULL;
-	
-    xc = (pic_xs > scr_xs) ? scr_xs : pic_xs;
-    yc = (pic_ys > scr_ys) ? scr_ys : pic_ys;
+	const unsigned char *pattern;
+	unsigned char buf[DITHER_SPAN * 3];
+	unsigned int n;
 
-#if 0
-	/* if you need to debug */
-	printf("-----------------\n") ;
-	printf("pic_xs=%d\n", pic_xs) ;
-	printf("pic_ys=%d\n", pic_ys) ;
-	printf("scr_xs=%d\n", scr_xs) ;
-	printf("scr_ys=%d\n", scr_ys) ;
-	printf("xp=%d\n", xp) ;
-	printf("yp=%d\n", yp) ;
-	printf("xoffs=%d\n", xoffs) ;
-	printf("yoffs=%d\n", yoffs) ;
-	printf("cpp=%d\n", cpp) ;
-	printf("xc=%d\n", xc) ;
-	printf("yc=%d\n", yc) ;
-	printf("-----------------\n") ;
-#endif
-    
-	fb = mmap(NULL, scr_xs * scr_ys * cpp, PROT_WRITE | PROT_READ, MAP_SHARED, fh, 0);
-	
-	if(fb == MAP_FAILED)
+	if(!s->dither)
 	{
-		perror("mmap");
+		s->convert(dst, rgbbuff, count);
 		return;
 	}
 
-	if(cpp == 1)
+	/* the pattern is tied to the image, so it moves along when panning */
+	pattern = s->thresholds + ((y & 7) * (DITHER_SPAN + 8) + (x & 7)) * 3;
+	for(; count; count -= n, dst += n * s->cpp, rgbbuff += n * 3)
 	{
-	    get8map(fh, &map_back);
-	    set332map(fh);
+		n = min(count, DITHER_SPAN);
+		dither_row(buf, rgbbuff, pattern, s->scales, n);
+		s->convert(dst, buf, n);
 	}
+}
 
-	fbptr = fb     + (yoffs * scr_xs + xoffs) * cpp;
-	imptr = fbbuff + (yp	* pic_xs + xp) * cpp;
-	
-	if(alpha)
+/*
+ * n pixels (bpp bytes each) of a plane of the frame, from x, y of the
+ * image as shown. Upright planes are read in place, turned ones are
+ * gathered into buf.
+ */
+static const unsigned char *frame_pixels(const struct fb_frame *f, const unsigned char *plane, int bpp, int x, int y, int n, unsigned char *buf)
+{
+	unsigned char *p = buf;
+	long at, step;
+	int k;
+
+	switch(f->orient)
 	{
-	 	unsigned char * alphaptr;
-		int from, to, x;
+		case 0:
+			return plane + ((size_t) y * f->x_size + x) * bpp;
+		case 1:
+			at = (long) (f->x_size - 1 - x) * f->y_size + y;
+			step = -f->y_size;
+			break;
+		case 2:
+			at = (long) (f->y_size - 1 - y) * f->x_size + f->x_size - 1 - x;
+			step = -1;
+			break;
+		default:
+			at = (long) x * f->y_size + f->y_size - 1 - y;
+			step = f->y_size;
+			break;
+	}
+	if(bpp == 1)
+		for(k = 0; k < n; k++, at += step)
+			*(p++) = plane[at];
+	else
+		for(k = 0; k < n; k++, at += step)
+		{
+			const unsigned char *q = plane + at * 3;
+
+			*(p++) = q[0];
+			*(p++) = q[1];
+			*(p++) = q[2];
+		}
+	return buf;
+}
+
+/*
+ * rows rows of n pixels from x, y of a plane turned a quarter, into buf
+ * one after the other. Rows next to each other in the image are pixels
+ * next to each other in the plane, so a block of rows is read a run of
+ * rows pixels at a time, and not one pixel of every plane line a row.
+ */
+static void gather_rows(const struct fb_frame *f, const unsigned char *plane, int bpp, int x, int y, int n, int rows, unsigned char *buf)
+{
+	long at, step, down;
+	int k, j;
 
-		if (savebuf)
+	if(f->orient == 1)
+	{
+		at = (long) (f->x_size - 1 - x) * f->y_size + y;
+		step = -f->y_size;
+		down = 1;
+	}
+	else
+	{
+		at = (long) x * f->y_size + f->y_size - 1 - y;
+		step = f->y_size;
+		down = -1;
+	}
+	if(bpp == 1)
+		for(k = 0; k < n; k++, at += step)
+			for(j = 0; j < rows; j++)
+				buf[(size_t) j * n + k] = plane[at + j * down];
+	else
+		for(k = 0; k < n; k++, at += step)
+			for(j = 0; j < rows; j++)
+			{
+				const unsigned char *q = plane + (at + j * down) * 3;
+				unsigned char *p = buf + ((size_t) j * n + k) * 3;
+
+				p[0] = q[0];
+				p[1] = q[1];
+				p[2] = q[2];
+			}
+}
+
+/*
+ * frame_pixels() for row y of rows up to y_end, read in order: a frame
+ * turned a quarter is gathered TURN_ROWS rows at a time into buf, which
+ * holds TURN_ROWS rows. *held is the first row in buf, -1 to start with.
+ */
+static const unsigned char *band_pixels(const struct fb_frame *f, const unsigned char *plane, int bpp, int x, int y, int n, int y_end, unsigned char *buf, int *held)
+{
+	if(!(f->orient & 1))
+		return frame_pixels(f, plane, bpp, x, y, n, buf);
+	if(*held < 0 || y < *held || y >= *held + TURN_ROWS)
+	{
+		*held = y;
+		gather_rows(f, plane, bpp, x, y, n, min(TURN_ROWS, y_end - y), buf);
+	}
+	return buf + (size_t) (y - *held) * n * bpp;
+}
+
+/* the pixel x, y of the image in its tile, which must have pixels */
+static inline unsigned char *cache_pixels(const struct fb_cache *c, int x, int y, int cpp)
+{
+	const struct fb_tile *t = c->tile + (y / FB_TILE) * c->cols + x / FB_TILE;
+
+	return t->pixels + ((y % FB_TILE) * FB_TILE + x % FB_TILE) * cpp;
+}
+
+/* n converted pixels from x, y of the image to dst ... */
+static void copy_native(const struct fb_cache *c, unsigned char *dst, int x, int y, int n, int cpp)
+{
+	int k;
+
+	for(; n > 0; n -= k, x += k, dst += k * cpp)
+	{
+		k = min(n, FB_TILE - x % FB_TILE);
+		memcpy(dst, cache_pixels(c, x, y, cpp), k * cpp);
+	}
+}
+
+/* ... and back */
+static void store_native(struct fb_cache *c, const unsigned char *src, int x, int y, int n, int cpp)
+{
+	int k;
+
+	for(; n > 0; n -= k, x += k, src += k * cpp)
+	{
+		k = min(n, FB_TILE - x % FB_TILE);
+		memcpy(cache_pixels(c, x, y, cpp), src, k * cpp);
+	}
+}
+
+static struct fb_cache *cache_new(struct fb_session *s, int x_size, int y_size)
+{
+	struct fb_cache *c;
+	int screen = (s->var.xres / FB_TILE + 2) * (s->var.yres / FB_TILE + 2);
+
+	if(!(c = (struct fb_cache *) calloc(1, sizeof(*c))))
+		return NULL;
+	c->cols = (x_size + FB_TILE - 1) / FB_TILE;
+	c->rows = (y_size + FB_TILE - 1) / FB_TILE;
+	c->cpp = s->cpp;
+	if(!(c->tile = (struct fb_tile *) calloc(c->cols * c->rows, sizeof(struct fb_tile))))
+	{
+		free(c);
+		return NULL;
+	}
+
+	/*
+	 * A few screens, and at least two rows of tiles for a blit done a row
+	 * at a time. Diffused errors run through the whole image, it is kept whole.
+	 */
+	c->limit = c->cols * c->rows;
+	if(!(s->dither & FB_DIFFUSE))
+		c->limit = min(c->limit, max(4 * screen, 2 * c->cols));
+	return c;
+}
+
+void fb_cache_free(struct fb_cache *c)
+{
+	int k;
+
+	if(!c)
+		return;
+	for(k = 0; k < c->cols * c->rows; k++)
+		pool_free(c->tile[k].pixels);
+	free(c->tile);
+	free(c);
+}
+
+/* memory held by the converted tiles */
+size_t fb_cache_bytes(const struct fb_cache *c)
+{
+	return c ? (size_t) c->count * FB_TILE * FB_TILE * c->cpp : 0;
+}
+
+/* the tiles under r (image coordinates) have to be converted again */
+static void cache_damage(struct fb_cache *c, const struct fb_rect *r)
+{
+	int tx, ty;
+	int x0 = max(r->x, 0) / FB_TILE, x1 = min((r->x + r->w - 1) / FB_TILE, c->cols - 1);
+	int y0 = max(r->y, 0) / FB_TILE, y1 = min((r->y + r->h - 1) / FB_TILE, c->rows - 1);
+
+	for(ty = y0; ty <= y1; ty++)
+		for(tx = x0; tx <= x1; tx++)
+			c->tile[ty * c->cols + tx].valid = 0;
+}
+
+/*
+ * pixels for a tile: new ones up to the limit, after that those of the
+ * tile least recently used, but not by the blit stamped now
+ */
+static unsigned char *tile_pixels(struct fb_session *s, struct fb_cache *c, unsigned int now)
+{
+	struct fb_tile *t, *lru = NULL;
+	unsigned char *p;
+	int k;
+
+	if(c->count < c->limit && (p = (unsigned char *) pool_alloc(FB_TILE * FB_TILE * s->cpp)))
+	{
+		c->count++;
+		return p;
+	}
+	for(k = 0; k < c->cols * c->rows; k++)
+	{
+		t = c->tile + k;
+		if(t->pixels && t->used != now && (!lru || t->used < lru->used))
+			lru = t;
+	}
+	if(!lru)
+		return NULL;
+	p = lru->pixels;
+	lru->pixels = NULL;
+	lru->valid = 0;
+	return p;
+}
+
+/* tiles to convert, split over the worker threads */
+struct tile_job
+{
+	struct fb_session *s;
+	const struct fb_frame *f;
+	const int *todo;
+};
+
+static void convert_tiles(void *arg, int first, int last, int band)
+{
+	struct tile_job *j = (struct tile_job *) arg;
+	const struct fb_frame *f = j->f;
+	const struct fb_cache *c = f->native;
+	unsigned char buf[FB_TILE * 3 * TURN_ROWS];
+	int k, y, x0, y0, w, h, held, cpp = j->s->cpp;
+
+	for(k = first; k < last; k++)
+	{
+		unsigned char *dst = c->tile[j->todo[k]].pixels;
+
+		x0 = j->todo[k] % c->cols * FB_TILE;
+		y0 = j->todo[k] / c->cols * FB_TILE;
+		w = min(FB_TILE, f->x_size - x0);
+		h = min(FB_TILE, f->y_size - y0);
+		held = -1;
+		for(y = 0; y < h; y++, dst += FB_TILE * cpp)
+			convert_row(j->s, dst, band_pixels(f, f->rgb, 3, x0, y0 + y, w, y0 + h, buf, &held), w, x0, y0 + y);
+	}
+}
+
+/*
+ * the tiles under r (window coordinates) at hand and converted;
+ * -1 if there is no memory for them
+ */
+static int cache_prepare(struct fb_session *s, const struct fb_frame *f, const struct fb_rect *r)
+{
+	struct fb_cache *c = f->native;
+	struct fb_tile *t;
+	struct tile_job j;
+	int x0 = (f->x_pan + r->x) / FB_TILE, x1 = (f->x_pan + r->x + r->w - 1) / FB_TILE;
+	int y0 = (f->y_pan + r->y) / FB_TILE, y1 = (f->y_pan + r->y + r->h - 1) / FB_TILE;
+	int tx, ty, k, n = 0, *todo;
+	unsigned int now = ++c->clock;
+
+	if(!(todo = (int *) malloc((x1 - x0 + 1) * (y1 - y0 + 1) * sizeof(int))))
+		return -1;
+	for(ty = y0; ty <= y1; ty++)
+		for(tx = x0; tx <= x1; tx++)
 		{
-			if (save)
+			t = c->tile + ty * c->cols + tx;
+			t->used = now;
+			if(!t->pixels)
 			{
-				unsigned char *sp = malloc(xc * yc * cpp);
-				if (sp)
+				if(!(t->pixels = tile_pixels(s, c, now)))
 				{
-					unsigned char *p=sp, *p2=fbptr;
-	    			for(i = 0; i < yc; i++, p2 += scr_xs * cpp, p += xc * cpp)
-						memcpy(p, p2, xc * cpp);
-					*savebuf = sp;
+					free(todo);
+					return -1;
 				}
+				t->valid = 0;
+			}
+			if(!t->valid)
+				todo[n++] = ty * c->cols + tx;
+		}
+
+	j.s = s;
+	j.f = f;
+	j.todo = todo;
+	threads_run(convert_tiles, &j, n, FB_TILE * FB_TILE);
+	for(k = 0; k < n; k++)
+		c->tile[todo[k]].valid = 1;
+	free(todo);
+	return 0;
+}
+
+/*
+ * Floyd-Steinberg over the whole image into its converted copy. Every
+ * pixel is converted and read back, so the error is measured against
+ * what the framebuffer really shows (the palette levels on 8bpp, too).
+ */
+static void diffuse_image(struct fb_session *s, const struct fb_frame *f)
+{
+	struct fb_cache *nc = f->native;
+	int w = f->x_size, cpp = s->cpp, x, y, k, c, e, held = -1;
+	int *err, *cur, *next, *t;
+	unsigned char want[3], got[3], *dst, *row, *line = NULL;
+	const unsigned char *src;
+
+	/* the cache was made to hold every tile */
+	for(k = 0; k < nc->cols * nc->rows; k++)
+		if(!nc->tile[k].pixels)
+		{
+			if(!(nc->tile[k].pixels = (unsigned char *) pool_alloc(FB_TILE * FB_TILE * cpp)))
+				return;
+			nc->count++;
+		}
+
+	/* errors are kept times 16, with a spare pixel at either end */
+	if(!(err = (int *) calloc((w + 2) * 3 * 2, sizeof(int))))
+		return;
+	if(!(row = (unsigned char *) malloc(w * cpp)) ||
+	   (f->orient && !(line = (unsigned char *) malloc(w * 3 * TURN_ROWS))))
+	{
+		free(row);
+		free(err);
+		return;
+	}
+	cur = err + 3;
+	next = err + (w + 2) * 3 + 3;
+
+	for(y = 0; y < f->y_size; y++)
+	{
+		src = band_pixels(f, f->rgb, 3, 0, y, w, f->y_size, line, &held);
+		dst = row;
+		memset(next - 3, 0, (w + 2) * 3 * sizeof(int));
+		for(x = 0; x < w; x++, src += 3, dst += cpp)
+		{
+			for(k = 0; k < 3; k++)
+			{
+				c = src[k] + cur[x * 3 + k] / 16;
+				want[k] = (c < 0) ? 0 : (c > 255) ? 255 : c;
+			}
+			s->convert(dst, want, 1);
+			s->unpack(got, dst, 1);
+			for(k = 0; k < 3; k++)
+			{
+				e = want[k] - got[k];
+				cur[(x + 1) * 3 + k] += e * 7;
+				next[(x - 1) * 3 + k] += e * 3;
+				next[x * 3 + k] += e * 5;
+				next[(x + 1) * 3 + k] += e;
 			}
-			saveptr = *savebuf;
 		}
+		store_native(nc, row, 0, y, w, cpp);
+		t = cur;
+		cur = next;
+		next = t;
+	}
+	for(k = 0; k < nc->cols * nc->rows; k++)
+		nc->tile[k].valid = 1;
+	free(line);
+	free(row);
+	free(err);
+}
+
+/*
+ * draw the part r (window coordinates) of a frame into the page at page_y;
+ * scratch is ROWBUF_LINE bytes
+ */
+static void blit_rows(struct fb_session *s, unsigned int page_y, const struct fb_frame *f, const struct fb_rect *r, unsigned char *scratch)
+{
+	unsigned int scr_xs = s->x_stride;
+	int cpp = s->cpp;
+	int i, xc = r->w, yc = r->h, held = -1, held_alpha = -1;
+	int xp = f->x_pan + r->x, yp = f->y_pan + r->y;
+	unsigned char *turned = scratch + scr_xs * 3, *turned_alpha = turned + scr_xs * 3 * TURN_ROWS;
+
+	unsigned char *fbptr;
+	const unsigned char *imptr;
+
+#if 0
+	/* if you need to debug */
+	printf("-----------------\n") ;
+	printf("pic_xs=%d\n", f->x_size) ;
+	printf("pic_ys=%d\n", f->y_size) ;
+	printf("xp=%d\n", f->x_pan + r->x) ;
+	printf("yp=%d\n", f->y_pan + r->y) ;
+	printf("xoffs=%d\n", f->x_offs + r->x) ;
+	printf("yoffs=%d\n", f->y_offs + r->y + page_y) ;
+	printf("xc=%d\n", xc) ;
+	printf("yc=%d\n", yc) ;
+	printf("-----------------\n") ;
+#endif
+
+	/* the image stays RGB, pixels are converted as they are written out */
+	fbptr = s->draw + ((page_y + f->y_offs + r->y) * scr_xs + f->x_offs + r->x) * cpp;
+	
+	if(f->alpha)
+	{
+	 	const unsigned char *alphaptr;
+	 	unsigned char *bgptr = NULL;
+		int from, to, x;
 
-		alphaptr = alpha + (yp	* pic_xs + xp);
+		if(f->bg)
+			bgptr = f->bg + (r->y * f->w + r->x) * cpp;
 		
-		for(i = 0; i < yc; i++, fbptr += scr_xs * cpp, imptr += pic_xs * cpp, alphaptr += pic_xs)
+		for(i = 0; i < yc; i++, fbptr += scr_xs * cpp)
 		{
-			if (saveptr)
-				memcpy(fbptr, saveptr + (i * pic_xs * cpp), xc * cpp);
-			else
-				memset(fbptr, 0x00, xc * cpp);
-			for(x = 0; x<xc; x++)
+			alphaptr = band_pixels(f, f->alpha, 1, xp, yp + i, xc, yp + yc, turned_alpha, &held_alpha);
+			imptr = NULL;
+			if(!f->native)
+				imptr = band_pixels(f, f->rgb, 3, xp, yp + i, xc, yp + yc, turned, &held);
+
+			/* runs of opaque, transparent and translucent pixels */
+			for(x = 0; x < xc; x = to)
 			{
-				int v;
-				
-				from = to = -1;
-				for(v = x; v<xc; v++)
+				int c = alpha_class(alphaptr[x]);
+
+				for(to = x + 1; to < xc && alpha_class(alphaptr[to]) == c; to++);
+				from = x;
+
+				if(c == ALPHA_OPAQUE)
 				{
-					if(from == -1)
-					{
-						if(alphaptr[v] > 0x80) from = v;
-					}
+					if(f->native)
+						copy_native(f->native, fbptr + from * cpp, xp + from, yp + i, to - from, cpp);
 					else
-					{
-						if(alphaptr[v] < 0x80)
-						{
-							to = v;
-							break;
-						}
-					}
+						convert_row(s, fbptr + from * cpp, imptr + from * 3, to - from,
+							xp + from, yp + i);
 				}
-				if(from == -1)
+				else if(c == ALPHA_CLEAR)
 				{
-					break;
+					if(bgptr)
+						memcpy(fbptr + from * cpp, bgptr + from * cpp, (to - from) * cpp);
+					else
+						memset(fbptr + from * cpp, 0x00, (to - from) * cpp);
+				}
+				else
+				{
+					unsigned char *rgb = scratch + from * 3;
+
+					if(!imptr)
+						imptr = band_pixels(f, f->rgb, 3, xp, yp + i, xc, yp + yc, turned, &held);
+					if(bgptr)
+						s->unpack(rgb, bgptr + from * cpp, to - from);
+					else
+						memset(rgb, 0x00, (to - from) * 3);
+					blend_row(rgb, imptr + from * 3, alphaptr + from, to - from);
+					convert_row(s, fbptr + from * cpp, rgb, to - from,
+						xp + from, yp + i);
 				}
-					
-				if(to == -1) to = xc;
-				
-				memcpy(fbptr + (from * cpp), imptr + (from * cpp), (to - from - 1) * cpp);
-				x += to - from - 1;
 			}
+			if(bgptr)
+				bgptr += f->w * cpp;
+			push(s, fbptr, xc * cpp);
 		}
 	}
+	else if(f->native)
+	    /* a redraw of a converted image is a plain copy */
+	    for(i = 0; i < yc; i++, fbptr += scr_xs * cpp)
+	    {
+			copy_native(f->native, fbptr, xp, yp + i, xc, cpp);
+			push(s, fbptr, xc * cpp);
+	    }
 	else
-	    for(i = 0; i < yc; i++, fbptr += scr_xs * cpp, imptr += pic_xs * cpp)
-			memcpy(fbptr, imptr, xc * cpp);
-		
-	if(cpp == 1)
-	    set8map(fh, &map_back);
-	
-	munmap(fb, scr_xs * scr_ys * cpp);
+	    for(i = 0; i < yc; i++, fbptr += scr_xs * cpp)
+	    {
+			convert_row(s, fbptr, band_pixels(f, f->rgb, 3, xp, yp + i, xc, yp + yc, turned, &held), xc, xp, yp + i);
+			push(s, fbptr, xc * cpp);
+	    }
 }
 
-inline static unsigned char make8color(unsigned char r, unsigned char g, unsigned char b)
+/* one job for the worker threads: rows of a rectangle, or of the window being moved */
+struct blit_job
+{
+	struct fb_session *s;
+	unsigned int page_y, src_y;
+	const struct fb_frame *f;
+	const struct fb_rect *r;
+	int dx, dy;
+};
+
+static void blit_band(void *arg, int first, int last, int band)
 {
-    return (
-	(((r >> 5) & 7) << 5) |
-	(((g >> 5) & 7) << 2) |
-	 ((b >> 6) & 3)       );
+	struct blit_job *j = (struct blit_job *) arg;
+	struct fb_rect r = *j->r;
+
+	r.y += first;
+	r.h = last - first;
+	blit_rows(j->s, j->page_y, j->f, &r, j->s->rowbuf + band * ROWBUF_LINE(j->s));
 }
 
-inline static unsigned short make15color(unsigned char r, unsigned char g, unsigned char b)
+/*
+ * Large rectangles are split into row bands over the worker threads.
+ * The tiles of a cached image are made ready first, a row of tiles at a
+ * time if the rectangle needs more of them than the cache keeps.
+ */
+static void blit2FB(struct fb_session *s, unsigned int page_y, const struct fb_frame *f, const struct fb_rect *r)
 {
-    return (
-	(((r >> 3) & 31) << 10) |
-	(((g >> 3) & 31) << 5)  |
-	 ((b >> 3) & 31)        );
+	struct fb_cache *c = f->native;
+	struct blit_job j;
+	struct fb_frame plain;
+	struct fb_rect strip;
+	int across, down;
+
+	j.s = s;
+	j.page_y = page_y;
+	j.f = f;
+	j.r = r;
+	if(!c || rect_empty(r))
+	{
+		threads_run(blit_band, &j, r->h, r->w);
+		return;
+	}
+
+	across = (f->x_pan + r->x + r->w - 1) / FB_TILE - (f->x_pan + r->x) / FB_TILE + 1;
+	down = (f->y_pan + r->y + r->h - 1) / FB_TILE - (f->y_pan + r->y) / FB_TILE + 1;
+	strip = *r;
+	j.r = &strip;
+	for(; strip.y < r->y + r->h; strip.y += strip.h)
+	{
+		strip.h = r->y + r->h - strip.y;
+		if(across * down > c->limit)
+			strip.h = min(strip.h, FB_TILE - (f->y_pan + strip.y) % FB_TILE);
+
+		/* out of memory, convert on the fly */
+		j.f = f;
+		if(cache_prepare(s, f, &strip))
+		{
+			plain = *f;
+			plain.native = NULL;
+			j.f = &plain;
+		}
+		threads_run(blit_band, &j, strip.h, strip.w);
+	}
 }
 
-inline static unsigned short make16color(unsigned char r, unsigned char g, unsigned char b)
+/* keep what is under the window, translucent pixels are blended over it */
+static void save_background(struct fb_session *s, unsigned int page_y, const struct fb_frame *f, unsigned char **savebuf)
 {
-    return (
-	(((r >> 3) & 31) << 11) |
-	(((g >> 2) & 63) << 5)  |
-	 ((b >> 3) & 31)        );
+	unsigned int line = s->x_stride * s->cpp, len = f->w * s->cpp;
+	unsigned char *sp, *p, *p2;
+	int i;
+
+	if(!(sp = pool_alloc(len * f->h)))
+		return;
+
+	p2 = s->draw + (page_y + f->y_offs) * line + f->x_offs * s->cpp;
+	for(i = 0, p = sp; i < f->h; i++, p2 += line, p += len)
+		memcpy(p, p2, len);
+	*savebuf = sp;
 }
 
-void* convertRGB2FB(int fh, unsigned char *rgbbuff, unsigned long count, int bpp, int *cpp)
+static void move_band(void *arg, int first, int last, int band)
 {
-    unsigned long i;
-    void *fbbuff = NULL;
-	u_int8_t  *c_fbbuff;
-    u_int16_t *s_fbbuff;
-    u_int32_t *i_fbbuff;
+	struct blit_job *j = (struct blit_job *) arg;
+	struct fb_session *s = j->s;
+	unsigned int line = s->x_stride * s->cpp;
+	int dx = j->dx, dy = j->dy, x = max(0, -dx), w = j->f->w - abs(dx), h = last - first;
+	unsigned char *dst, *src;
+	int i, step = line;
 
-    switch(bpp)
-    {
-	case 8:
-	    *cpp = 1;
-	    c_fbbuff = (unsigned char *) malloc(count * sizeof(unsigned char));
-	    for(i = 0; i < count; i++)
-		c_fbbuff[i] = make8color(rgbbuff[i*3], rgbbuff[i*3+1], rgbbuff[i*3+2]);
-	    fbbuff = (void *) c_fbbuff;
-	    break;
-	case 15:
-	    *cpp = 2;
-	    s_fbbuff = (unsigned short *) malloc(count * sizeof(unsigned short));
-	    for(i = 0; i < count ; i++)
-		s_fbbuff[i] = make15color(rgbbuff[i*3], rgbbuff[i*3+1], rgbbuff[i*3+2]);
-	    fbbuff = (void *) s_fbbuff;
-	    break;
-	case 16:
-	    *cpp = 2;
-	    s_fbbuff = (unsigned short *) malloc(count * sizeof(unsigned short));
-	    for(i = 0; i < count ; i++)
-		s_fbbuff[i] = make16color(rgbbuff[i*3], rgbbuff[i*3+1], rgbbuff[i*3+2]);
-	    fbbuff = (void *) s_fbbuff;
-	    break;
-    case 24:  /* BGR666 */
-	    *cpp = 3;
-	    i_fbbuff = (unsigned int *) malloc(count * sizeof(unsigned int));
-	    for(i = 0; i < count * 3 ; i += 3)
-		{   // Skip 24 bit at a time
-			c_fbbuff = (u_int8_t  *)i_fbbuff ;
-		    c_fbbuff[i + 0] = (u_int8_t)( (rgbbuff[i+2] >> 2) | ((rgbbuff[i+1] & 0x0C) << 4) );
-		    c_fbbuff[i + 1] = (u_int8_t)( ((rgbbuff[i+1] & 0xF0) >> 4) | ((rgbbuff[i+0] & 0x3C) << 2) );
-		    c_fbbuff[i + 2] = (u_int8_t)( (rgbbuff[i+0] & 0xC0) >> 6 );
+	dst = s->draw + (j->page_y + j->f->y_offs + max(0, -dy) + first) * line + (j->f->x_offs + x) * s->cpp;
+	src = s->draw + (j->src_y + j->f->y_offs + max(0, dy) + first) * line + (j->f->x_offs + x + dx) * s->cpp;
+
+	/* rows moving down inside one page are copied bottom up */
+	if(dy < 0 && j->page_y == j->src_y)
+	{
+		dst += (h - 1) * line;
+		src += (h - 1) * line;
+		step = -step;
+	}
+	for(i = 0; i < h; i++, dst += step, src += step)
+	{
+		memmove(dst, src, w * s->cpp);
+		push(s, dst, w * s->cpp);
+	}
+}
+
+/*
+ * Scroll the window contents by (dx, dy) image pixels: what is still
+ * visible is copied from the page at src_y (which may be the page we draw
+ * into) instead of being converted again. Rows moving up or down inside
+ * one page depend on each other, only other moves are split into bands.
+ */
+static void move_window(struct fb_session *s, unsigned int page_y, unsigned int src_y, const struct fb_frame *f, int dx, int dy)
+{
+	struct blit_job j;
+	int h = f->h - abs(dy);
+
+	j.s = s;
+	j.page_y = page_y;
+	j.src_y = src_y;
+	j.f = f;
+	j.dx = dx;
+	j.dy = dy;
+	if(dy && page_y == src_y)
+		move_band(&j, 0, h, 0);
+	else
+		threads_run(move_band, &j, h, f->w - abs(dx));
+}
+
+static int rect_empty(const struct fb_rect *r)
+{
+	return r->w <= 0 || r->h <= 0;
+}
+
+static struct fb_rect rect_union(struct fb_rect a, struct fb_rect b)
+{
+	struct fb_rect r;
+
+	if(rect_empty(&a))
+		return b;
+	if(rect_empty(&b))
+		return a;
+	r.x = min(a.x, b.x);
+	r.y = min(a.y, b.y);
+	r.w = max(a.x + a.w, b.x + b.w) - r.x;
+	r.h = max(a.y + a.h, b.y + b.h) - r.y;
+	return r;
+}
+
+/* image area r as seen through the window of frame f */
+static struct fb_rect rect_window(const struct fb_frame *f, const struct fb_rect *r)
+{
+	struct fb_rect w;
+	int x1 = min(r->x + r->w - f->x_pan, f->w), y1 = min(r->y + r->h - f->y_pan, f->h);
+
+	w.x = max(r->x - f->x_pan, 0);
+	w.y = max(r->y - f->y_pan, 0);
+	w.w = x1 - w.x;
+	w.h = y1 - w.y;
+	if(rect_empty(&w))
+		w.w = w.h = 0;
+	return w;
+}
+
+/*
+ * Bring the page at page_y up to frame f. Without a dirty rectangle
+ * the whole window is drawn, otherwise the window is scrolled by
+ * (dx, dy) and only the strips that scrolled in and the dirty part are.
+ */
+static void draw_frame(struct fb_session *s, unsigned int page_y, unsigned int src_y, const struct fb_frame *f, const struct fb_rect *dirty, int dx, int dy)
+{
+	struct fb_rect r;
+
+	if(!dirty)
+	{
+		r.x = r.y = 0;
+		r.w = f->w;
+		r.h = f->h;
+		blit2FB(s, page_y, f, &r);
+		return;
+	}
+
+	if(dx || dy)
+	{
+		move_window(s, page_y, src_y, f, dx, dy);
+		if(dy)
+		{
+			r.x = 0;
+			r.y = (dy > 0) ? f->h - dy : 0;
+			r.w = f->w;
+			r.h = abs(dy);
+			blit2FB(s, page_y, f, &r);
 		}
-	    fbbuff = (void *) i_fbbuff;
-	    break;
-	case 32:
-	    *cpp = 4;
-	    i_fbbuff = (unsigned int *) malloc(count * sizeof(unsigned int));
-	    for(i = 0; i < count ; i++)
-		i_fbbuff[i] = ((rgbbuff[i*3] << 16) & 0xFF0000) |
-			    ((rgbbuff[i*3+1] << 8) & 0xFF00) |
-			    (rgbbuff[i*3+2] & 0xFF);
-	    fbbuff = (void *) i_fbbuff;
-	    break;
-	default:
-	    fprintf(stderr, "Unsupported video mode! You've got: %dbpp\n", bpp);
-	    exit(1);
-    }
-    return fbbuff;
+		if(dx)
+		{
+			r.x = (dx > 0) ? f->w - dx : 0;
+			r.y = max(0, -dy);
+			r.w = abs(dx);
+			r.h = f->h - abs(dy);
+			blit2FB(s, page_y, f, &r);
+		}
+	}
+
+	if(!rect_empty(dirty))
+		blit2FB(s, page_y, f, dirty);
 }
@@ -0,0 +1,256 @@
+/*
+    fbv  --  simple image viewer for the linux framebuffer
+    Copyright (C) 2000  Tomasz Sterna
+    Copyright (C) 2003  Mateusz Golicz
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * An offscreen framebuffer: the screen is a memory file (or a real one)
+ * and the fbdev requests are answered here, so everything fb_display.c
+ * does can run without a display. The device name is
+ *
+ *	<width>x<height>[x<bpp>][/<red>,<green>,<blue>[,<transp>]][@<file>]
+ *
+ * with each channel given as offset:length, e.g. "800x600x16" or
+ * "640x480x32/0:8,8:8,16:8@screen.raw". Without a file the pixels live
+ * in an anonymous memory file. The virtual screen can be grown and
+ * panned around, there is no vertical blank.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* memfd_create() */
+#endif
+#include <linux/fb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <asm/types.h>
+#include "fbv.h"
+
+static struct fb_var_screeninfo var;
+static struct fb_fix_screeninfo fix;
+static __u16 cmap[3][256];
+
+static void set_bitfield(struct fb_bitfield *b, int offset, int length)
+{
+	b->offset = offset;
+	b->length = length;
+	b->msb_right = 0;
+}
+
+static int parse_bitfield(const char **p, struct fb_bitfield *b)
+{
+	char *end;
+	long offset, length;
+
+	offset = strtol(*p, &end, 10);
+	if(end == *p || *end != ':')
+		return -1;
+	*p = end + 1;
+	length = strtol(*p, &end, 10);
+	if(end == *p || offset < 0 || length < 0 || offset + length > 32)
+		return -1;
+	*p = end;
+	set_bitfield(b, offset, length);
+	return 0;
+}
+
+static int parse_spec(const char *spec, const char **file)
+{
+	const char *p;
+	char *end;
+	unsigned int w, h, bpp = 32;
+
+	w = strtoul(spec, &end, 10);
+	if(end == spec || *end != 'x')
+		return -1;
+	p = end + 1;
+	h = strtoul(p, &end, 10);
+	if(end == p)
+		return -1;
+	p = end;
+	if(*p == 'x')
+	{
+		bpp = strtoul(++p, &end, 10);
+		if(end == p)
+			return -1;
+		p = end;
+	}
+	if(!w || !h || w > 16384 || h > 16384)
+		return -1;
+
+	memset(&var, 0, sizeof(var));
+	var.xres = var.xres_virtual = w;
+	var.yres = var.yres_virtual = h;
+	var.bits_per_pixel = bpp;
+	switch(bpp)
+	{
+		case 8:
+			set_bitfield(&var.red, 0, 8);
+			set_bitfield(&var.green, 0, 8);
+			set_bitfield(&var.blue, 0, 8);
+			break;
+		case 15:
+			set_bitfield(&var.red, 10, 5);
+			set_bitfield(&var.green, 5, 5);
+			set_bitfield(&var.blue, 0, 5);
+			break;
+		case 16:
+			set_bitfield(&var.red, 11, 5);
+			set_bitfield(&var.green, 5, 6);
+			set_bitfield(&var.blue, 0, 5);
+			break;
+		case 24:
+		case 32:
+			set_bitfield(&var.red, 16, 8);
+			set_bitfield(&var.green, 8, 8);
+			set_bitfield(&var.blue, 0, 8);
+			break;
+		default:
+			return -1;
+	}
+
+	if(*p == '/')
+	{
+		p++;
+		if(parse_bitfield(&p, &var.red) || *p++ != ',' ||
+		   parse_bitfield(&p, &var.green) || *p++ != ',' ||
+		   parse_bitfield(&p, &var.blue))
+			return -1;
+		if(*p == ',')
+		{
+			p++;
+			if(parse_bitfield(&p, &var.transp))
+				return -1;
+		}
+	}
+
+	*file = NULL;
+	if(*p == '@' && p[1])
+		*file = p + 1;
+	else if(*p)
+		return -1;
+	return 0;
+}
+
+/* the memory file always holds the whole virtual screen */
+static int resize(int fh)
+{
+	unsigned int len = var.xres_virtual * ((var.bits_per_pixel + 7) / 8) * var.yres_virtual;
+
+	if(len > fix.smem_len && ftruncate(fh, len))
+		return -1;
+	fix.line_length = var.xres_virtual * ((var.bits_per_pixel + 7) / 8);
+	fix.smem_len = max(len, fix.smem_len);
+	return 0;
+}
+
+static int offscreen_open(const char *name)
+{
+	const char *file;
+	int fh;
+
+	if(parse_spec(name, &file))
+	{
+		fprintf(stderr, "offscreen: bad screen '%s', use <w>x<h>[x<bpp>][/<r>,<g>,<b>[,<t>]][@<file>]\n", name);
+		exit(1);
+	}
+
+	memset(&fix, 0, sizeof(fix));
+	strcpy(fix.id, "offscreen");
+	fix.type = FB_TYPE_PACKED_PIXELS;
+	fix.visual = (var.bits_per_pixel == 8) ? FB_VISUAL_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
+	fix.xpanstep = 1;
+	fix.ypanstep = 1;
+
+	if(file)
+		fh = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	else
+		fh = memfd_create("fbv-offscreen", 0);
+	if(fh == -1 || resize(fh))
+	{
+		fprintf(stderr, "offscreen %s: %s\n", file ? file : "memory", strerror(errno));
+		exit(1);
+	}
+	return fh;
+}
+
+static void offscreen_close(int fh)
+{
+	close(fh);
+}
+
+static int offscreen_ioctl(int fh, unsigned long req, void *arg)
+{
+	struct fb_var_screeninfo *v = (struct fb_var_screeninfo *) arg;
+	struct fb_cmap *map = (struct fb_cmap *) arg;
+	unsigned int i;
+
+	switch(req)
+	{
+		case FBIOGET_VSCREENINFO:
+			*v = var;
+			return 0;
+		case FBIOGET_FSCREENINFO:
+			*(struct fb_fix_screeninfo *) arg = fix;
+			return 0;
+		case FBIOPUT_VSCREENINFO:
+			/* only the virtual size and the offsets may change */
+			if(v->xres != var.xres || v->yres != var.yres || v->bits_per_pixel != var.bits_per_pixel ||
+			   v->xres_virtual > 16384 || v->yres_virtual > 16384)
+				break;
+			var.xres_virtual = max(v->xres_virtual, var.xres);
+			var.yres_virtual = max(v->yres_virtual, var.yres);
+			var.xoffset = min(v->xoffset, var.xres_virtual - var.xres);
+			var.yoffset = min(v->yoffset, var.yres_virtual - var.yres);
+			if(resize(fh))
+				return -1;
+			*v = var;
+			return 0;
+		case FBIOPAN_DISPLAY:
+			if(v->xoffset + var.xres > var.xres_virtual || v->yoffset + var.yres > var.yres_virtual)
+				break;
+			var.xoffset = v->xoffset;
+			var.yoffset = v->yoffset;
+			return 0;
+		case FBIOGETCMAP:
+		case FBIOPUTCMAP:
+			if(map->start + map->len > 256)
+				break;
+			for(i = 0; i < map->len; i++)
+			{
+				__u16 *c[3] = { map->red + i, map->green + i, map->blue + i };
+				int k;
+
+				for(k = 0; k < 3; k++)
+					if(req == FBIOGETCMAP)
+						*c[k] = cmap[k][map->start + i];
+					else
+						cmap[k][map->start + i] = *c[k];
+			}
+			return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+const struct fb_backend fb_offscreen = { offscreen_open, offscreen_close, offscreen_ioctl };
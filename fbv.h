@@ -23,8 +23,91 @@
 #define FH_ERROR_FORMAT 2	/* file format error */
 #define FH_ERROR_MEM 3		/* memory alloc error */
 
-void fb_display(unsigned char *rgbbuff, unsigned char * alpha, int x_size, int y_size, int x_pan, int y_pan, int x_offs, int y_offs, unsigned char **savebuf, int save);
-void getCurrentRes(int *x, int *y);
+struct fb_session;
+struct fb_cache;
+
+/* fb_open() flags */
+#define FB_DOUBLEBUF 1		/* flip between two pages if the device can pan */
+#define FB_VSYNC 2		/* put frames on screen on a vertical blank */
+#define FB_DITHER 4		/* ordered dithering for formats below 8 bits a channel */
+#define FB_DIFFUSE 8		/* ... error diffusion for whole images, with FB_DITHER */
+#define FB_HWPAN 16		/* pan large images with the display offset */
+#define FB_SHADOW 32		/* draw into a copy in RAM, never read the video memory */
+
+/*
+ * Part of an image that changed since the last fb_display() call. A
+ * NULL damage redraws everything, an empty one (w or h 0) tells that only
+ * the panning may have changed.
+ */
+struct fb_rect
+{
+	int x, y, w, h;
+};
+
+struct fb_session *fb_open(const char *name, int flags);
+void fb_close(struct fb_session *s);
+/*
+ * cache, if not NULL, keeps the image converted to the framebuffer format
+ * across calls, in tiles converted as they come into view. It is made on
+ * first use and must be freed with fb_cache_free() by the caller when the
+ * image changes in any way other than through damage.
+ * orient is how many quarter turns right rgbbuff and alpha still need
+ * to be shown upright; x_size and y_size are the size after the turn.
+ */
+void fb_display(struct fb_session *s, unsigned char *rgbbuff, unsigned char * alpha, int orient, int x_size, int y_size, int x_pan, int y_pan, int x_offs, int y_offs, const struct fb_rect *damage, struct fb_cache **cache, unsigned char **savebuf, int save);
+void fb_cache_free(struct fb_cache *c);
+size_t fb_cache_bytes(const struct fb_cache *c);
+void getCurrentRes(struct fb_session *s, int *x, int *y);
+int fb_dump(struct fb_session *s, const char *name);
+
+/*
+ * Where the screen comes from: anything that answers the fbdev requests
+ * (FBIOGET_VSCREENINFO, FBIOPAN_DISPLAY, ...) the way the kernel does,
+ * and whose handle can be mmapped. fb_open() picks the backend by the
+ * device name, "offscreen:<spec>" is a screen in memory.
+ */
+struct fb_backend
+{
+	int (*open)(const char *name);		/* exits if it cannot */
+	void (*close)(int fh);
+	int (*ioctl)(int fh, unsigned long req, void *arg);
+};
+
+extern const struct fb_backend fb_offscreen;
+
+/* framebuffer pixel layout, as in fb_var_screeninfo */
+struct fb_channel
+{
+	int offset, length;
+};
+
+struct fb_format
+{
+	int bpp;			/* bits per pixel */
+	int cpp;			/* bytes per pixel */
+	int pseudocolor;		/* 8 bit with the 332 palette */
+	struct fb_channel red, green, blue, transp;
+};
+
+typedef void (*fb_convert_fn)(void *dst, const unsigned char *rgbbuff, unsigned int count);
+fb_convert_fn selectRGB2FB(const struct fb_format *fmt);
+typedef void (*fb_unpack_fn)(unsigned char *rgbbuff, const void *src, unsigned int count);
+fb_unpack_fn selectFB2RGB(const struct fb_format *fmt);
+void blend_row(unsigned char *dst, const unsigned char *src, const unsigned char *alpha, unsigned int count);
+void dither_row(unsigned char *dst, const unsigned char *rgbbuff, const unsigned char *threshold, const unsigned char *scale, unsigned int count);
+
+/* size-classed buffers for images and their transforms, see pool.c */
+void *pool_alloc(size_t len);
+void pool_free(void *p);
+void pool_report(void);
+
+/* worker threads for row loops, see threads.c */
+#define THREADS_MIN_WORK 65536	/* pixels below which a band is not worth a thread */
+typedef void (*threads_fn)(void *arg, int first, int last, int band);
+void threads_init(int threads);
+void threads_exit(void);
+int threads_count(void);
+void threads_run(threads_fn fn, void *arg, int count, int cost);
 
 int fh_bmp_id(char *name);
 int fh_bmp_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,int y);
@@ -50,14 +133,14 @@ int fh_gif_get_delay(void);
 int fh_gif_get_disposal_method(void);
 int fh_gif_get_userinput(void);
 
+/* an image as decoded, or one of its transforms */
 struct image
 {
-	int width, height;
+	int width, height;		/* as shown */
 	unsigned char *rgb;
 	unsigned char *alpha;
-	unsigned char *nextrgb;
-	unsigned char *nextalpha;
-	unsigned char *saved;
+	int orientation;		/* quarter turns right the planes are still to get */
+	struct fb_cache *native;	/* rgb converted for the framebuffer */
 };
 
 #ifndef min
@@ -69,8 +152,14 @@ struct image
 unsigned char * simple_resize(unsigned char * orgin,int ox,int oy,int dx,int dy);
 unsigned char * alpha_resize(unsigned char * alpha,int ox,int oy,int dx,int dy);
 unsigned char * color_average_resize(unsigned char * orgin,int ox,int oy,int dx,int dy);
-unsigned char * rotate(unsigned char *i, int ox, int oy, int rot);
-unsigned char * alpha_rotate(unsigned char *i, int ox, int oy, int rot);
+unsigned char * half_resize(unsigned char * orgin,int ox,int oy,int ch);
+/* resize quality, the 'k' key steps through these */
+#define RESIZE_NEAREST 0
+#define RESIZE_AVERAGE 1
+#define RESIZE_BILINEAR 2
+#define RESIZE_LANCZOS 3
+#define RESIZE_MODES 4
+unsigned char * filter_resize(unsigned char * orgin,int ox,int oy,int dx,int dy,int ch,int filter);
 
 #ifdef DEBUG
 	extern int debugme;
@@ -19,7 +19,6 @@
 */
 #include "config.h"
 #ifdef FBV_SUPPORT_GIF
-#include "fbv.h"
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -30,6 +29,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include "fbv.h"
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define gflush return(FH_ERROR_FILE);
 #define grflush { DGifCloseFile(gft, &error); BUG return(FH_ERROR_FORMAT); }
@@ -132,7 +132,7 @@ int fh_gif_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 				}
 				lb=(char*)malloc(px*3);
 				slb=(char*) malloc(px);
-				image=(char*)malloc(x*y*3);
+				image=(char*)pool_alloc(x*y*3);
 				if(lb!=NULL && slb!=NULL && image!=NULL)
 				{
 					unsigned char *alphabuffer = NULL;
@@ -148,9 +148,13 @@ int fh_gif_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 
 					ibxs=ibxs*3;
 
+					/* pooled buffers are not cleared, the frame may not fill the screen */
+					memset(image + px * py * 3, 0, (x * y - px * py) * 3);
 					if(transparency != -1)
 					{
-						alphabuffer = malloc(px * py);
+						alphabuffer = pool_alloc(x * y);
+						if(alphabuffer)
+							memset(alphabuffer + px * py, 0, x * y - px * py);
 					}
 					alphas[imagecount] = alphabuffer;
 					imagecount++;
@@ -193,7 +197,7 @@ int fh_gif_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 					}
 					if (!loadedfirstimage)
 					{
-						wr_buffer = (unsigned char*)malloc(x*y*3);
+						wr_buffer = (unsigned char*)pool_alloc(x*y*3);
 						if (!wr_buffer)
 							return FH_ERROR_MEM;
 
@@ -202,7 +206,7 @@ int fh_gif_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 						{
 							if (alphabuffer)
 							{
-								unsigned char *wr_alpha = malloc(x*y);
+								unsigned char *wr_alpha = pool_alloc(x*y);
 								if (wr_alpha)
 								{
 									memcpy(wr_alpha, alphabuffer, x*y);
@@ -210,7 +214,7 @@ int fh_gif_load(char *name,unsigned char **buffer, unsigned char **alpha, int x,
 								}
 								else
 								{
-									free(wr_buffer);
+									pool_free(wr_buffer);
 									return FH_ERROR_MEM;
 								}
 							}
@@ -275,7 +279,7 @@ int fh_gif_next(unsigned char **buffer, unsigned char **alpha, int x, int y)
 
 	if (imagecount==0)
 		return(FH_ERROR_FORMAT);
-	wr_buffer = (unsigned char*)malloc(x*y*3);
+	wr_buffer = (unsigned char*)pool_alloc(x*y*3);
 	if (!wr_buffer)
 		return FH_ERROR_MEM;
 
@@ -287,7 +291,7 @@ int fh_gif_next(unsigned char **buffer, unsigned char **alpha, int x, int y)
 	{
 		if (alphas[imageix])
 		{
-			unsigned char *wr_alpha = malloc(x*y);
+			unsigned char *wr_alpha = pool_alloc(x*y);
 			if (wr_alpha)
 			{
 				memcpy(wr_alpha, alphas[imageix], x*y);
@@ -295,7 +299,7 @@ int fh_gif_next(unsigned char **buffer, unsigned char **alpha, int x, int y)
 			}
 			else
 			{
-				free(wr_buffer);
+				pool_free(wr_buffer);
 				return(FH_ERROR_MEM);
 			}
 		}
@@ -312,10 +316,10 @@ int fh_gif_unload(void)
 	for (i=0; i<imagecount; i++)
 	{
 		if (images[i])
-			free(images[i]);
+			pool_free(images[i]);
 		images[i] = NULL;
 		if (alphas[i])
-			free(alphas[i]);
+			pool_free(alphas[i]);
 		alphas[i] = NULL;
 	}
 	imagecount=0;
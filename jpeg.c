@@ -68,14 +68,14 @@ int fh_jpeg_load(char *filename,unsigned char **buffer, unsigned char **alpha, i
 	FILE *fh;
 	JSAMPLE *lb;
 
-	wr_buffer = (unsigned char*)malloc(x*y*3);
+	wr_buffer = (unsigned char*)pool_alloc(x*y*3);
 	if (!wr_buffer)
 		return FH_ERROR_MEM;
 
 	ciptr=&cinfo;
 	if(!(fh=fopen(filename,"rb")))
 	{
-		free(wr_buffer);
+		pool_free(wr_buffer);
 		return(FH_ERROR_FILE);
 	}
 	ciptr->err=jpeg_std_error(&emgr.pub);
@@ -85,7 +85,7 @@ int fh_jpeg_load(char *filename,unsigned char **buffer, unsigned char **alpha, i
 		// FATAL ERROR - Free the object and return...
 		jpeg_destroy_decompress(ciptr);
 		fclose(fh);
-		free(wr_buffer);
+		pool_free(wr_buffer);
 		return(FH_ERROR_FORMAT);
 	}
 	
@@ -114,7 +114,7 @@ int fh_jpeg_load(char *filename,unsigned char **buffer, unsigned char **alpha, i
 	{
 		jpeg_destroy_decompress(ciptr);
 		fclose(fh);
-		free(wr_buffer);
+		pool_free(wr_buffer);
 		return(FH_ERROR_FORMAT);
 	}
 	jpeg_finish_decompress(ciptr);
@@ -28,6 +28,7 @@
 #include <termios.h>
 #include <string.h>
 #include <signal.h>
+#include <math.h>
 #include <time.h>
 #include "config.h"
 #include "fbv.h"
@@ -41,13 +42,24 @@ static int opt_clear = 1,
 	   opt_stretch = 0,
 	   opt_delay = 0,
 	   opt_enlarge = 0,
-	   opt_ignore_aspect = 0;
+	   opt_ignore_aspect = 0,
+	   opt_doublebuf = 0,
+	   opt_vsync = 0,
+	   opt_dither = 0,
+	   opt_threads = 0,
+	   opt_hwpan = 0,
+	   opt_shadow = 0,
+	   opt_quality = -1;
+static char *opt_dump = NULL;
+static const char *resize_names[RESIZE_MODES] = { "nearest", "average", "bilinear", "lanczos" };
+
+static struct fb_session *fb = NULL;
 
 #ifdef DEBUG
 int debugme = 0;
-#define FREE_POINTER(x)  { if (debugme) fprintf(stderr, "free %p  line=%d\n", x, __LINE__); free(x); x = NULL; }
+#define FREE_POINTER(x)  { if (debugme) fprintf(stderr, "free %p  line=%d\n", x, __LINE__); pool_free(x); x = NULL; }
 #else
-#define FREE_POINTER(x) free(x)
+#define FREE_POINTER(x) pool_free(x)
 #endif
 
 
@@ -68,198 +80,417 @@ void setup_console(int t)
 	
 }
 
-static inline void do_rotate(struct image *i, int rot)
+/* enlarging has nothing to average, the box filter is bilinear there */
+static unsigned char *resize_image(unsigned char *image, int ox, int oy, int dx, int dy, int quality, int enlarge)
 {
-	if(rot)
+	if(quality == RESIZE_AVERAGE && enlarge)
+		quality = RESIZE_BILINEAR;
+	switch(quality)
 	{
-		unsigned char *nextimage, *nextalpha=NULL;
-		unsigned char *previmage, *prevalpha;
-		int t;
-		
-		if (i->nextrgb)
-			previmage = i->nextrgb;
-		else
-			previmage = i->rgb;
-		if (i->nextalpha)
-			prevalpha = i->nextalpha;
-		else
-			prevalpha = i->alpha;
-		nextimage = rotate(previmage, i->width, i->height, rot);
-		if (debugme) fprintf(stdout, "rotate new %p\n", nextimage);
-		if(prevalpha)
-			nextalpha = alpha_rotate(prevalpha, i->width, i->height, rot);
-
-		if (i->nextrgb)
-			FREE_POINTER(i->nextrgb);
-		if (i->nextalpha)
-			FREE_POINTER(i->nextalpha);
-		i->nextrgb = nextimage;
-		i->nextalpha = nextalpha;
-
-		if(rot & 1)
-		{
-			t = i->width;
-			i->width = i->height;
-			i->height = t;
-		}
+		case RESIZE_AVERAGE:
+			return color_average_resize(image, ox, oy, dx, dy);
+		case RESIZE_BILINEAR:
+		case RESIZE_LANCZOS:
+			return filter_resize(image, ox, oy, dx, dy, 3, quality);
 	}
+	return simple_resize(image, ox, oy, dx, dy);
 }
 
+static unsigned char *resize_alpha(unsigned char *alpha, int ox, int oy, int dx, int dy, int quality)
+{
+	if(quality == RESIZE_BILINEAR || quality == RESIZE_LANCZOS)
+		return filter_resize(alpha, ox, oy, dx, dy, 1, quality);
+	return alpha_resize(alpha, ox, oy, dx, dy);
+}
 
-static inline void do_enlarge(struct image *i, int screen_width, int screen_height, int ignoreaspect)
+/* the size an image of *width x *height is shrunk to, to fit the screen */
+static void fit_size(int *width, int *height, int screen_width, int screen_height, int ignoreaspect)
 {
-	if(((i->width > screen_width) || (i->height > screen_height)) && (!ignoreaspect))
+	int w = *width, h = *height;
+
+	if((w <= screen_width) && (h <= screen_height))
 		return;
-	if((i->width < screen_width) || (i->height < screen_height))
+	if(ignoreaspect)
 	{
-		int xsize = i->width, ysize = i->height;
-		unsigned char *nextimage, *nextalpha=NULL;
-		unsigned char *previmage, *prevalpha;
-		
-		if(ignoreaspect)
-		{
-			if(i->width < screen_width)
-				xsize = screen_width;
-			if(i->height < screen_height)
-				ysize = screen_height;
-			
-			goto have_sizes;
-		}
-		
-		if((i->height * screen_width / i->width) <= screen_height)
-		{
-			xsize = screen_width;
-			ysize = i->height * screen_width / i->width;
-			goto have_sizes;
-		}
-		
-		if((i->width * screen_height / i->height) <= screen_width)
-		{
-			xsize = i->width * screen_height / i->height;
-			ysize = screen_height;
-			goto have_sizes;
-		}
+		if(w > screen_width)
+			*width = screen_width;
+		if(h > screen_height)
+			*height = screen_height;
+	}
+	else if((h * screen_width / w) <= screen_height)
+	{
+		*width = screen_width;
+		*height = h * screen_width / w;
+	}
+	else
+	{
+		*width = w * screen_height / h;
+		*height = screen_height;
+	}
+	/* a very long thin image must not shrink to nothing across */
+	*width = max(*width, 1);
+	*height = max(*height, 1);
+}
+
+/* ... and the size it is enlarged to, to fill the screen */
+static void enlarge_size(int *width, int *height, int screen_width, int screen_height, int ignoreaspect)
+{
+	int w = *width, h = *height;
+
+	if(((w > screen_width) || (h > screen_height)) && (!ignoreaspect))
 		return;
-have_sizes:
-		if (i->nextrgb)
-			previmage = i->nextrgb;
-		else
-			previmage = i->rgb;
-		if (i->nextalpha)
-			prevalpha = i->nextalpha;
-		else
-			prevalpha = i->alpha;
-		nextimage = simple_resize(previmage, i->width, i->height, xsize, ysize);
-		if (debugme) fprintf(stdout, "enlarge new %p\n", nextimage);
-		if(prevalpha)
-			nextalpha = alpha_resize(prevalpha, i->width, i->height, xsize, ysize);
-		
-		i->width = xsize;
-		i->height = ysize;
-		if (i->nextrgb)
-			FREE_POINTER(i->nextrgb);
-		if (i->nextalpha)
-			FREE_POINTER(i->nextalpha);
-		i->nextrgb = nextimage;
-		i->nextalpha = nextalpha;
+	if((w >= screen_width) && (h >= screen_height))
+		return;
+	if(ignoreaspect)
+	{
+		if(w < screen_width)
+			*width = screen_width;
+		if(h < screen_height)
+			*height = screen_height;
+	}
+	else if((h * screen_width / w) <= screen_height)
+	{
+		*width = screen_width;
+		*height = h * screen_width / w;
+	}
+	else if((w * screen_height / h) <= screen_width)
+	{
+		*width = w * screen_height / h;
+		*height = screen_height;
 	}
+	*width = max(*width, 1);
+	*height = max(*height, 1);
+}
+
+/* what an image is transformed with */
+struct transform_key
+{
+	int rotation, stretch, enlarge, iaspect, quality;
+	int zoom;			/* in steps of ZOOM_STEPS to a doubling */
+};
+
+#define ZOOM_STEPS 4
+#define ZOOM_MAX_SIZE 16384		/* no zooming in beyond this ... */
+#define ZOOM_MIN_SIZE 16		/* ... or out below this */
+#define ZOOM_SCREENS 16			/* ... or in to more screenfuls than this */
+
+static double zoom_scale(int steps)
+{
+	return pow(2.0, (double) steps / ZOOM_STEPS);
 }
 
+/*
+ * Whether i, from the decoded image src, may be zoomed in a step. The
+ * whole image is resized, so it must fit in a few screens (or be no
+ * bigger than src) and in the memory that is free.
+ */
+static int zoom_in_allowed(const struct image *i, const struct image *src, int screen_width, int screen_height)
+{
+	double w = i->width * zoom_scale(1), h = i->height * zoom_scale(1);
+	double limit = max((double) src->width * src->height, (double) ZOOM_SCREENS * screen_width * screen_height);
+	long pages = sysconf(_SC_AVPHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+
+	if(max(w, h) > ZOOM_MAX_SIZE || w * h > limit)
+		return 0;
+	return pages <= 0 || page <= 0 || w * h * (src->alpha ? 4 : 3) <= (double) pages * page;
+}
 
-static inline void do_fit_to_screen(struct image *i, int screen_width, int screen_height, int ignoreaspect, int cal)
+/*
+ * The decoded image at half, quarter, ... the size, for zooming out:
+ * a zoomed image is resampled from the smallest level that is still at
+ * least as large, not from the full size. The levels are made when
+ * first asked for.
+ */
+#define PYRAMID_LEVELS 12
+
+struct pyramid
+{
+	struct image level[PYRAMID_LEVELS];	/* level[0] is half the decoded size */
+	int count;
+};
+
+static const struct image *pyramid_level(struct pyramid *p, const struct image *src, int width, int height)
 {
-	if((i->width > screen_width) || (i->height > screen_height))
+	const struct image *l = src;
+	int n;
+
+	for(n = 0; n < PYRAMID_LEVELS && l->width / 2 >= width && l->height / 2 >= height; n++)
 	{
-		unsigned char *nextimage, *nextalpha=NULL;
-		unsigned char *previmage, *prevalpha;
-		int nx_size = i->width, ny_size = i->height;
-		
-		if(ignoreaspect)
+		if(n == p->count)
 		{
-			if(i->width > screen_width)
-				nx_size = screen_width;
-			if(i->height > screen_height)
-				ny_size = screen_height;
-		}
-		else
-		{
-			if((i->height * screen_width / i->width) <= screen_height)
-			{
-				nx_size = screen_width;
-				ny_size = i->height * screen_width / i->width;
-			}
-			else
+			struct image *h = &p->level[n];
+
+			h->width = l->width / 2;
+			h->height = l->height / 2;
+			h->orientation = 0;
+			h->native = NULL;
+			h->alpha = NULL;
+			if(!(h->rgb = half_resize(l->rgb, l->width, l->height, 3)))
+				break;
+			if(l->alpha && !(h->alpha = half_resize(l->alpha, l->width, l->height, 1)))
 			{
-				nx_size = i->width * screen_height / i->height;
-				ny_size = screen_height;
+				FREE_POINTER(h->rgb);
+				break;
 			}
+			if (debugme) fprintf(stdout, "pyramid level %d: %dx%d\n", n + 1, h->width, h->height);
+			p->count++;
 		}
-		
-		if (i->nextrgb)
-			previmage = i->nextrgb;
-		else
-			previmage = i->rgb;
-		if (i->nextalpha)
-			prevalpha = i->nextalpha;
-		else
-			prevalpha = i->alpha;
-		if(cal)
-			nextimage = color_average_resize(previmage, i->width, i->height, nx_size, ny_size);
-		else
-			nextimage = simple_resize(previmage, i->width, i->height, nx_size, ny_size);
-		
-		if(prevalpha)
-			nextalpha = alpha_resize(prevalpha, i->width, i->height, nx_size, ny_size);
-		
-		i->width = nx_size;
-		i->height = ny_size;
-		if (i->nextrgb)
-			FREE_POINTER(i->nextrgb);
-		if (i->nextalpha)
-			FREE_POINTER(i->nextalpha);
-		i->nextrgb = nextimage;
-		i->nextalpha = nextalpha;
+		l = &p->level[n];
 	}
+	return l;
 }
 
-static inline void do_display(struct image *i, int x_pan, int y_pan, int x_offs, int y_offs, int newimage)
+static void pyramid_free(struct pyramid *p)
 {
-	unsigned char *image, *alpha;
+	while(p->count)
+	{
+		struct image *l = &p->level[--p->count];
 
-	if (i->nextrgb)
-		image = i->nextrgb;
-	else
-		image = i->rgb;
-	if (i->nextalpha)
-		alpha = i->nextalpha;
-	else
-		alpha = i->alpha;
+		FREE_POINTER(l->rgb);
+		if(l->alpha)
+			FREE_POINTER(l->alpha);
+	}
+}
 
-	if (newimage)
+/*
+ * Rotation, fitting, enlarging and zooming in one go, from the decoded
+ * image src into t. The turn is only noted down, fb_display() reads the
+ * planes in turned order; the final size is worked out first and the
+ * planes are resized to it, unturned, in a single pass. If there is
+ * nothing to resize t shares the planes of src. Returns -1, with nothing
+ * kept in t, if there is no memory for the resized planes; with nothing
+ * to resize it can not fail.
+ */
+static int do_transform(struct image *t, const struct image *src, struct pyramid *pyr, const struct transform_key *k, int screen_width, int screen_height)
+{
+	int w, h, dw, dh;
+
+	t->orientation = k->rotation & 3;
+	t->rgb = src->rgb;
+	t->alpha = src->alpha;
+	t->native = NULL;
+	t->width = w = (t->orientation & 1) ? src->height : src->width;
+	t->height = h = (t->orientation & 1) ? src->width : src->height;
+
+	if(k->stretch)
+		fit_size(&w, &h, screen_width, screen_height, k->iaspect);
+	if(k->enlarge)
+		enlarge_size(&w, &h, screen_width, screen_height, k->iaspect);
+	if(k->zoom)
 	{
-		if (i->saved)
-			FREE_POINTER(i->saved);
-		i->saved = NULL;
+		double scale = zoom_scale(k->zoom);
+
+		w = max((int) (w * scale + 0.5), 1);
+		h = max((int) (h * scale + 0.5), 1);
 	}
+	if(w == t->width && h == t->height)
+		return 0;
 
-	if (debugme) fprintf(stdout, "display %p\n", image);
-	fb_display(image, alpha, i->width, i->height, x_pan, y_pan, x_offs, y_offs, 
-					alpha ? &(i->saved) : NULL, newimage);
+	/* the size of the planes as they are stored */
+	dw = (t->orientation & 1) ? h : w;
+	dh = (t->orientation & 1) ? w : h;
+	if(k->zoom)
+		src = pyramid_level(pyr, src, dw, dh);
 
-	if (i->nextrgb)
+	t->rgb = resize_image(src->rgb, src->width, src->height, dw, dh, k->quality, (dw > src->width) || (dh > src->height));
+	if (debugme) fprintf(stdout, "transform new %p\n", t->rgb);
+	if(!t->rgb)
+		return -1;
+	if(src->alpha && !(t->alpha = resize_alpha(src->alpha, src->width, src->height, dw, dh, k->quality)))
 	{
-		if (i->rgb)
-			FREE_POINTER(i->rgb);
-		i->rgb = i->nextrgb;
-		i->nextrgb = NULL;
+		FREE_POINTER(t->rgb);
+		return -1;
 	}
-	if (i->nextalpha)
+	t->width = w;
+	t->height = h;
+	return 0;
+}
+
+/* the key of the image only turned, which needs no memory to transform */
+static void unresized_key(struct transform_key *k)
+{
+	k->stretch = k->enlarge = k->iaspect = k->quality = k->zoom = 0;
+}
+
+/*
+ * The transforms of the image shown so far, so that going back to one
+ * is only a redraw. Each keeps its converted copy too. The least recently
+ * shown ones are dropped when there are too many or their resized planes
+ * and converted tiles take more than TRANSFORM_CACHE_BYTES.
+ */
+#define TRANSFORM_CACHE_SIZE 8
+#define TRANSFORM_CACHE_BYTES (48 << 20)
+
+struct transform_cache
+{
+	struct cached_transform
+	{
+		struct transform_key key;
+		struct image i;
+		size_t bytes;		/* of the planes it does not share */
+		unsigned int used;	/* when it was last shown */
+	} entry[TRANSFORM_CACHE_SIZE];
+	int count;
+	unsigned int clock;
+};
+
+/* the planes of t that are not those of src, and its converted copy */
+static void release_transform(struct image *t, const struct image *src)
+{
+	if(t->rgb != src->rgb)
+		FREE_POINTER(t->rgb);
+	if(t->alpha != src->alpha)
+		FREE_POINTER(t->alpha);
+	fb_cache_free(t->native);
+	t->native = NULL;
+}
+
+static void cache_drop(struct transform_cache *c, int n, const struct image *src)
+{
+	release_transform(&c->entry[n].i, src);
+	c->entry[n] = c->entry[--c->count];
+}
+
+/* the converted copies grow as they are shown, they are counted when needed */
+static size_t cache_bytes(const struct transform_cache *c)
+{
+	size_t bytes = 0;
+	int n;
+
+	for(n = 0; n < c->count; n++)
+		bytes += c->entry[n].bytes + fb_cache_bytes(c->entry[n].i.native);
+	return bytes;
+}
+
+static struct image *cache_lookup(struct transform_cache *c, const struct transform_key *k)
+{
+	int n;
+
+	for(n = 0; n < c->count; n++)
+		if(!memcmp(&c->entry[n].key, k, sizeof(*k)))
+		{
+			c->entry[n].used = ++c->clock;
+			return &c->entry[n].i;
+		}
+	return NULL;
+}
+
+/* t is taken over by the cache; the pointer returned is good until the next insert */
+static struct image *cache_insert(struct transform_cache *c, const struct transform_key *k, const struct image *t, const struct image *src)
+{
+	struct cached_transform *e;
+	size_t bytes = 0;
+	int n, old;
+
+	if(t->rgb != src->rgb)
+		bytes += (size_t) t->width * t->height * 3;
+	if(t->alpha != src->alpha)
+		bytes += (size_t) t->width * t->height;
+
+	while(c->count && (c->count == TRANSFORM_CACHE_SIZE || cache_bytes(c) + bytes > TRANSFORM_CACHE_BYTES))
 	{
-		if (i->alpha)
-			FREE_POINTER(i->alpha);
-		i->alpha = i->nextalpha;
-		i->nextalpha = NULL;
+		for(n = old = 0; n < c->count; n++)
+			if(c->entry[n].used < c->entry[old].used)
+				old = n;
+		cache_drop(c, old, src);
 	}
+
+	e = &c->entry[c->count++];
+	e->key = *k;
+	e->i = *t;
+	e->bytes = bytes;
+	e->used = ++c->clock;
+	return &e->i;
+}
+
+static void cache_flush(struct transform_cache *c, const struct image *src)
+{
+	while(c->count)
+		cache_drop(c, c->count - 1, src);
+}
+
+/*
+ * Bounding box of the pixels in which the next animation frame b differs
+ * from a, the one on screen. Returns 0 if the frames can not be compared.
+ */
+static int frame_damage(const struct image *a, const struct image *b, struct fb_rect *r)
+{
+	unsigned char *aa = a->alpha, *ba = b->alpha;
+	int width = a->width, height = a->height, orient = a->orientation;
+	int x, y, y0, y1, x0, x1 = 0, line;
+
+	if(!a->rgb || !b->rgb || width != b->width || height != b->height || orient != b->orientation || !aa != !ba)
+		return 0;
+
+	/* the planes are compared as they are, unturned */
+	if(orient & 1)
+	{
+		width = a->height;
+		height = a->width;
+	}
+	line = width * 3;
+	x0 = width;
+
+#define ROW_SAME(y) (!memcmp(a->rgb + (y) * line, b->rgb + (y) * line, line) && \
+		     (!aa || !memcmp(aa + (y) * width, ba + (y) * width, width)))
+#define PIXEL_SAME(y, x) (!memcmp(a->rgb + (y) * line + (x) * 3, b->rgb + (y) * line + (x) * 3, 3) && \
+			  (!aa || aa[(y) * width + (x)] == ba[(y) * width + (x)]))
+
+	for(y0 = 0; y0 < height && ROW_SAME(y0); y0++);
+	for(y1 = height; y1 > y0 && ROW_SAME(y1 - 1); y1--);
+
+	for(y = y0; y < y1; y++)
+	{
+		for(x = 0; x < x0 && PIXEL_SAME(y, x); x++);
+		x0 = x;
+		for(x = width; x > x1 && PIXEL_SAME(y, x - 1); x--);
+		x1 = x;
+	}
+
+#undef ROW_SAME
+#undef PIXEL_SAME
+
+	r->w = max(x1 - x0, 0);
+	r->h = y1 - y0;
+	switch(orient)
+	{
+		case 0:
+			r->x = x0;
+			r->y = y0;
+			break;
+		case 1:
+			r->x = height - y1;
+			r->y = x0;
+			break;
+		case 2:
+			r->x = width - x1;
+			r->y = height - y1;
+			break;
+		case 3:
+			r->x = y0;
+			r->y = width - x1;
+			break;
+	}
+	if(orient & 1)
+	{
+		x = r->w;
+		r->w = r->h;
+		r->h = x;
+	}
+	return 1;
+}
+
+static inline void do_display(struct image *i, unsigned char **saved, int x_pan, int y_pan, int x_offs, int y_offs, int newimage, struct fb_rect *damage)
+{
+	if (newimage && *saved)
+	{
+		FREE_POINTER(*saved);
+		*saved = NULL;
+	}
+
+	if (debugme) fprintf(stdout, "display %p\n", i->rgb);
+	fb_display(fb, i->rgb, i->alpha, i->orientation, i->width, i->height, x_pan, y_pan, x_offs, y_offs, damage, &(i->native),
+					i->alpha ? saved : NULL, newimage);
 }
 
 int show_image(char *filename)
@@ -273,13 +504,19 @@ int show_image(char *filename)
 	unsigned char * alpha_ptr = NULL;
 	
 	int x_size, y_size, screen_width, screen_height;
-	int x_pan, y_pan, x_offs, y_offs, refresh = 1, c, ret = 1;
+	int x_pan = 0, y_pan = 0, x_offs, y_offs, refresh = 1, c, ret = 1;
 	int delay = opt_delay, retransform = 1;
 	
-	int transform_stretch = opt_stretch, transform_enlarge = opt_enlarge, transform_cal = (opt_stretch == 2),
-	    transform_iaspect = opt_ignore_aspect, transform_rotation = 0;
+	int transform_stretch = opt_stretch, transform_enlarge = opt_enlarge, transform_quality = opt_quality,
+	    transform_iaspect = opt_ignore_aspect, transform_rotation = 0, transform_zoom = 0, recenter = 0;
+	double center_x = 0.5, center_y = 0.5;
 	
-	struct image i;
+	struct image src, next, *shown = NULL, *found;
+	struct transform_key key, shown_key = { 0 };
+	struct transform_cache cache;
+	struct pyramid pyramid;
+	unsigned char *saved = NULL;
+	struct fb_rect damage, *dirty = NULL;
 
 	struct timespec refresh_ts, starttime_ts, now_ts, delta_ts;
 	struct timeval sleep_tv = { 0L , 1000L };
@@ -330,6 +567,17 @@ int show_image(char *filename)
 identified:
 	if (debugme) fprintf(stdout, "Image size: %dx%d\n", x_size, y_size);	
 
+	/* the decoded image is kept as it is, transforms go into the cache */
+	src.width = x_size;
+	src.height = y_size;
+	src.rgb = NULL;
+	src.alpha = NULL;
+	src.orientation = 0;
+	src.native = NULL;
+	cache.count = 0;
+	cache.clock = 0;
+	pyramid.count = 0;
+
 	if(load(filename, &image_ptr, opt_alpha ? &alpha_ptr : NULL, x_size, y_size) != FH_ERROR_OK)
 	{
 		fprintf(stderr, "%s: Image data is corrupt?\n", filename);
@@ -338,30 +586,68 @@ identified:
 
 	clock_gettime(CLOCK_REALTIME, &starttime_ts);
 
-	getCurrentRes(&screen_width, &screen_height);
+	getCurrentRes(fb, &screen_width, &screen_height);
 	
-	i.width = x_size;
-	i.height = y_size;
-	i.rgb = NULL;
-	i.nextrgb = image_ptr;
-	i.alpha = NULL;
-	i.nextalpha = alpha_ptr;
-	i.saved = NULL;
+	src.rgb = image_ptr;
+	src.alpha = alpha_ptr;
 
 	while(1)
 	{
 		if(retransform)
 		{
-			if(transform_rotation)
-				do_rotate(&i, transform_rotation);
-
-			if(transform_stretch)
-				do_fit_to_screen(&i, screen_width, screen_height, transform_iaspect, transform_cal);
+			/* a zoom keeps what is in the middle of the screen there */
+			if(recenter)
+			{
+				center_x = (x_pan + min(screen_width, shown->width) / 2.0) / shown->width;
+				center_y = (y_pan + min(screen_height, shown->height) / 2.0) / shown->height;
+			}
 
-			if(transform_enlarge)
-				do_enlarge(&i, screen_width, screen_height, transform_iaspect);
+			key.rotation = transform_rotation;
+			key.stretch = !!transform_stretch;
+			key.enlarge = transform_enlarge;
+			key.zoom = transform_zoom;
+			/* without resizing these make no difference */
+			key.iaspect = (key.stretch || key.enlarge) ? transform_iaspect : 0;
+			key.quality = (key.stretch || key.enlarge || key.zoom) ? transform_quality : 0;
+			if((found = cache_lookup(&cache, &key)))
+				shown = found;
+			else if(do_transform(&next, &src, &pyramid, &key, screen_width, screen_height) == 0)
+				shown = cache_insert(&cache, &key, &next, &src);
+			else if(shown)
+			{
+				/* no memory for it, the view stays as it was */
+				if (debugme) fprintf(stderr, "no memory for the transform\n");
+				transform_rotation = shown_key.rotation;
+				transform_stretch = shown_key.stretch;
+				transform_enlarge = shown_key.enlarge;
+				transform_zoom = shown_key.zoom;
+				if(shown_key.stretch || shown_key.enlarge)
+					transform_iaspect = shown_key.iaspect;
+				if(shown_key.stretch || shown_key.enlarge || shown_key.zoom)
+					transform_quality = shown_key.quality;
+				key = shown_key;
+				retransform = recenter = 0;
+				continue;
+			}
+			else
+			{
+				/* not even for the first one: the image as it is, only turned */
+				transform_stretch = transform_enlarge = transform_zoom = 0;
+				unresized_key(&key);
+				do_transform(&next, &src, &pyramid, &key, screen_width, screen_height);
+				shown = cache_insert(&cache, &key, &next, &src);
+			}
+			shown_key = key;
 
 			x_pan = y_pan = 0;
+			if(recenter)
+			{
+				if(shown->width > screen_width)
+					x_pan = min(max((int) (center_x * shown->width) - screen_width / 2, 0), shown->width - screen_width);
+				if(shown->height > screen_height)
+					y_pan = min(max((int) (center_y * shown->height) - screen_height / 2, 0), shown->height - screen_height);
+				recenter = 0;
+			}
 			if(opt_clear)
 			{
 				printf("\033[H\033[J");
@@ -373,20 +659,23 @@ identified:
 		}
 		if(refresh)
 		{
-			if(i.width < screen_width)
-				x_offs = (screen_width - i.width) / 2;
+			if(shown->width < screen_width)
+				x_offs = (screen_width - shown->width) / 2;
 			else
 				x_offs = 0;
 			
-			if(i.height < screen_height)
-				y_offs = (screen_height - i.height) / 2;
+			if(shown->height < screen_height)
+				y_offs = (screen_height - shown->height) / 2;
 			else
 				y_offs = 0;
 		
-			do_display(&i, x_pan, y_pan, x_offs, y_offs, retransform);
+			do_display(shown, &saved, x_pan, y_pan, x_offs, y_offs, retransform, dirty);
 
 			retransform = 0;
 			refresh = 0;
+			/* from here on only what changes is drawn */
+			dirty = &damage;
+			damage.w = damage.h = 0;
 			clock_gettime(CLOCK_REALTIME, &refresh_ts);
 		}
 
@@ -410,31 +699,32 @@ identified:
 					goto done;
 				case 'r':
 					refresh = 1;
+					dirty = NULL;
 					break;
 				case 'a': case 'D':
 					if(x_pan == 0) break;
-					x_pan -= i.width / PAN_STEPPING;
+					x_pan -= shown->width / PAN_STEPPING;
 					if(x_pan < 0) x_pan = 0;
 					refresh = 1;
 					break;
 				case 'd': case 'C':
 					if(x_offs) break;
-					if(x_pan >= (i.width - screen_width)) break;
-					x_pan += i.width / PAN_STEPPING;
-					if(x_pan > (i.width - screen_width)) x_pan = i.width - screen_width;
+					if(x_pan >= (shown->width - screen_width)) break;
+					x_pan += shown->width / PAN_STEPPING;
+					if(x_pan > (shown->width - screen_width)) x_pan = shown->width - screen_width;
 					refresh = 1;
 					break;
 				case 'w': case 'A':
 					if(y_pan == 0) break;
-					y_pan -= i.height / PAN_STEPPING;
+					y_pan -= shown->height / PAN_STEPPING;
 					if(y_pan < 0) y_pan = 0;
 					refresh = 1;
 					break;
 				case 'x': case 'B':
 					if(y_offs) break;
-					if(y_pan >= (i.height - screen_height)) break;
-					y_pan += i.height / PAN_STEPPING;
-					if(y_pan > (i.height - screen_height)) y_pan = i.height - screen_height;
+					if(y_pan >= (shown->height - screen_height)) break;
+					y_pan += shown->height / PAN_STEPPING;
+					if(y_pan > (shown->height - screen_height)) y_pan = shown->height - screen_height;
 					refresh = 1;
 					break;
 				case 'f': 
@@ -446,7 +736,7 @@ identified:
 					retransform = 1;
 					break;
 				case 'k':
-					transform_cal = !transform_cal;
+					transform_quality = (transform_quality + 1) % RESIZE_MODES;
 					retransform = 1;
 					break;
 				case 'i':
@@ -454,10 +744,12 @@ identified:
 					retransform = 1;
 					break;
 				case 'p':
-					transform_cal = 0;
+					transform_quality = RESIZE_NEAREST;
 					transform_iaspect = 0;
 					transform_enlarge = 0;
 					transform_stretch = 0;
+					transform_rotation = 0;
+					transform_zoom = 0;
 					retransform = 1;
 					break;
 				case 'n':
@@ -472,6 +764,18 @@ identified:
 						transform_rotation -= 4;
 					retransform = 1;
 					break;
+				case '+': case '=':
+					if(!zoom_in_allowed(shown, &src, screen_width, screen_height))
+						break;
+					transform_zoom++;
+					retransform = recenter = 1;
+					break;
+				case '-':
+					if(min(shown->width, shown->height) * zoom_scale(-1) < ZOOM_MIN_SIZE)
+						break;
+					transform_zoom--;
+					retransform = recenter = 1;
+					break;
 			}
 		}
 		else
@@ -506,27 +810,39 @@ identified:
 				refreshdelay_ms = refreshdelay();
 				if (refreshdelay_ms > 0 && delta_ms > refreshdelay_ms)
 				{
+					struct image prev = src;
+
 					if (loadnext(&image_ptr, opt_alpha ? &alpha_ptr : NULL, x_size, y_size) != FH_ERROR_OK)
 					{
 						fprintf(stderr, "%s: Next image failure?\n", filename);
 						goto error_mem;
 					}
 					if (debugme) fprintf(stdout, "reload new %p\n", image_ptr);
-					if (i.nextrgb)
-						FREE_POINTER(i.nextrgb);
-					if (i.nextalpha)
-						FREE_POINTER(i.nextalpha);
-					i.width = x_size;
-					i.height = y_size;
-					i.nextrgb = image_ptr;
-					i.nextalpha = alpha_ptr;
-
-					if(transform_rotation)
-						do_rotate(&i, transform_rotation);
-					if(transform_stretch)
-						do_fit_to_screen(&i, screen_width, screen_height, transform_iaspect, transform_cal);
-					if(transform_enlarge)
-						do_enlarge(&i, screen_width, screen_height, transform_iaspect);
+					src.rgb = image_ptr;
+					src.alpha = alpha_ptr;
+
+					/* the converted copy is kept if the damage is known, the other transforms go */
+					pyramid_free(&pyramid);
+					if(do_transform(&next, &src, &pyramid, &key, screen_width, screen_height))
+					{
+						transform_stretch = transform_enlarge = transform_zoom = 0;
+						unresized_key(&key);
+						do_transform(&next, &src, &pyramid, &key, screen_width, screen_height);
+					}
+					shown_key = key;
+					if(dirty && frame_damage(shown, &next, dirty))
+					{
+						next.native = shown->native;
+						shown->native = NULL;
+					}
+					else
+						dirty = NULL;
+					cache_flush(&cache, &prev);
+					if(prev.rgb)
+						FREE_POINTER(prev.rgb);
+					if(prev.alpha)
+						FREE_POINTER(prev.alpha);
+					shown = cache_insert(&cache, &key, &next, &src);
 					refresh = 1; 
 				}
 			}
@@ -543,16 +859,14 @@ done:
 error_mem:
 	if (unload)
 		unload();
-	if(i.nextrgb)
-		FREE_POINTER(i.nextrgb);
-	if(i.nextalpha)
-		FREE_POINTER(i.nextalpha);
-	if(i.rgb)
-		FREE_POINTER(i.rgb);
-	if(i.alpha)
-		FREE_POINTER(i.alpha);
-	if(i.saved)
-		FREE_POINTER(i.saved);
+	cache_flush(&cache, &src);
+	pyramid_free(&pyramid);
+	if(src.rgb)
+		FREE_POINTER(src.rgb);
+	if(src.alpha)
+		FREE_POINTER(src.alpha);
+	if(saved)
+		FREE_POINTER(saved);
 	return(ret);
 
 }
@@ -568,8 +882,16 @@ void help(char *name)
 		   " --noinfo      | -i : Supress image information\n"
 		   " --stretch     | -f : Strech (using a simple resizing routine) the image to fit onto screen if necessary\n"
 		   " --colorstretch| -k : Strech (using a 'color average' resizing routine) the image to fit onto screen if necessary\n"
+		   " --quality <q> | -q <q> : Resize with 'q', one of nearest, average, bilinear or lanczos\n"
 		   " --enlarge     | -e : Enlarge the image to fit the whole screen if necessary\n"
 		   " --ignore-aspect| -r : Ignore the image aspect while resizing\n"
+		   " --doublebuffer| -b : Draw into a hidden page and flip to it (if the device can pan)\n"
+		   " --vsync       | -v : Show new frames on a vertical blank (if the device supports it)\n"
+		   " --dither <m>  | -t <mode> : Dither on displays with fewer than 8 bits a color, 'mode' is ordered or diffusion\n"
+		   " --threads <n> | -j <n> : Use 'n' threads for drawing and resizing large images (default: one per CPU, up to 4)\n"
+		   " --hwpan       | -p : Pan large images with the display offset (if the device can pan)\n"
+		   " --shadow      | -o : Keep a copy of the screen in memory instead of reading the video memory back\n"
+		   " --dump <file> | -g <file> : Save the last screen to 'file' as a PPM image on exit\n"
            " --delay <d>   | -s <delay> : Slideshow, 'delay' is the slideshow delay in tenths of seconds.\n"
 #ifdef DEBUG
            " --debug       | -d : Display debug data.\n\n"
@@ -578,11 +900,12 @@ void help(char *name)
 		   " r            : Redraw the image\n"
 		   " a, d, w, x   : Pan the image\n"
 		   " f            : Toggle resizing on/off\n"
-		   " k            : Toggle resizing quality\n"
+		   " k            : Step through the resizing qualities\n"
 		   " e            : Toggle enlarging on/off\n"
 		   " i            : Toggle respecting the image aspect on/off\n"
 		   " n            : Rotate the image 90 degrees left\n"
 		   " m            : Rotate the image 90 degrees right\n"
+		   " +, -         : Zoom in and out\n"
 		   " p            : Disable all transformations\n"
 		   "[v.1.1] Copyright (C)2000-2017 Mateusz Golicz, Tomasz Sterna, Marco Cavallini, Kyle Farnsworth.\n", name);
 }
@@ -610,9 +933,17 @@ int main(int argc, char **argv)
 		{"noinfo",  	no_argument, 	0, 'i'},
 		{"stretch", 	no_argument, 	0, 'f'},
 		{"colorstrech", no_argument, 	0, 'k'},
+		{"quality",	required_argument, 0, 'q'},
 		{"delay", 	required_argument, 0, 's'},
 		{"enlarge",	no_argument,	0, 'e'},
 		{"ignore-aspect", no_argument,	0, 'r'},
+		{"doublebuffer", no_argument,	0, 'b'},
+		{"vsync", no_argument,	0, 'v'},
+		{"dither", required_argument, 0, 't'},
+		{"threads", required_argument, 0, 'j'},
+		{"hwpan", no_argument,	0, 'p'},
+		{"shadow", no_argument,	0, 'o'},
+		{"dump", required_argument, 0, 'g'},
 #ifdef DEBUG
 		{"debug", no_argument,	0, 'd'},
 #endif
@@ -627,7 +958,7 @@ int main(int argc, char **argv)
 		return(1);
 	}
 	
-	while((c = getopt_long_only(argc, argv, "hcauifks:erd", long_options, NULL)) != EOF)
+	while((c = getopt_long_only(argc, argv, "hcauifks:q:erbvt:j:pog:d", long_options, NULL)) != EOF)
 	{
 		switch(c)
 		{
@@ -655,12 +986,51 @@ int main(int argc, char **argv)
 			case 'k':
 				opt_stretch = 2;
 				break;
+			case 'q':
+				for(opt_quality = 0; opt_quality < RESIZE_MODES; opt_quality++)
+					if(!strcmp(optarg, resize_names[opt_quality]))
+						break;
+				if(opt_quality == RESIZE_MODES)
+				{
+					fprintf(stderr, "Unknown resize quality '%s', use nearest, average, bilinear or lanczos.\n", optarg);
+					return(1);
+				}
+				break;
 			case 'e':
 				opt_enlarge = 1;
 				break;
 			case 'r':
 				opt_ignore_aspect = 1;
 				break;
+			case 'b':
+				opt_doublebuf = 1;
+				break;
+			case 'v':
+				opt_vsync = 1;
+				break;
+			case 't':
+				if(!strcmp(optarg, "ordered"))
+					opt_dither = FB_DITHER;
+				else if(!strcmp(optarg, "diffusion"))
+					opt_dither = FB_DITHER | FB_DIFFUSE;
+				else
+				{
+					fprintf(stderr, "Unknown dither mode '%s', use ordered or diffusion.\n", optarg);
+					return(1);
+				}
+				break;
+			case 'j':
+				opt_threads = atoi(optarg);
+				break;
+			case 'p':
+				opt_hwpan = 1;
+				break;
+			case 'o':
+				opt_shadow = 1;
+				break;
+			case 'g':
+				opt_dump = optarg;
+				break;
 #ifdef DEBUG
 			case 'd':
 				debugme = 1;
@@ -691,6 +1061,14 @@ int main(int argc, char **argv)
 	
 	setup_console(1);
 
+	/* -k alone means the box filter, as it always did */
+	if(opt_quality < 0)
+		opt_quality = (opt_stretch == 2) ? RESIZE_AVERAGE : RESIZE_NEAREST;
+
+	threads_init(opt_threads);
+	fb = fb_open(NULL, (opt_doublebuf ? FB_DOUBLEBUF : 0) | (opt_vsync ? FB_VSYNC : 0) |
+		(opt_hwpan ? FB_HWPAN : 0) | (opt_shadow ? FB_SHADOW : 0) | opt_dither);
+
 	for(i = optind; argv[i]; )
 	{
 		int r = show_image(argv[i]);
@@ -702,6 +1080,12 @@ int main(int argc, char **argv)
 			i = optind;
 	}
 
+	if(opt_dump && fb_dump(fb, opt_dump))
+		fprintf(stderr, "Could not write %s: %s\n", opt_dump, strerror(errno));
+	fb_close(fb);
+	threads_exit();
+	if (debugme) pool_report();
+
 	setup_console(0);
 
 	if(opt_hide_cursor)
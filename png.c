@@ -84,7 +84,7 @@ int fh_png_load(char *name,unsigned char **buffer, unsigned char ** alpha,int x,
 		return(FH_ERROR_FORMAT);
 	}
 
-	wr_buffer = (unsigned char*)malloc(x*y*3);
+	wr_buffer = (unsigned char*)pool_alloc(x*y*3);
 	if (!wr_buffer)
 		return FH_ERROR_MEM;
 
@@ -113,7 +113,7 @@ int fh_png_load(char *name,unsigned char **buffer, unsigned char ** alpha,int x,
 		rp = (char*) malloc(width * 4);
 	    rptr[0] = (png_bytep) rp;
 		if (alpha)
-			*alpha = (unsigned char*) malloc(width * height);
+			*alpha = (unsigned char*) pool_alloc(width * height);
    
 	    for (pass = 0; pass < number_passes; pass++)
 		{
@@ -0,0 +1,192 @@
+/*
+    fbv  --  simple image viewer for the linux framebuffer
+    Copyright (C) 2000  Tomasz Sterna
+    Copyright (C) 2003  Mateusz Golicz
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * A pool for the big buffers: decoded frames, their transforms and the
+ * converted tiles. These come and go on every transform and animation
+ * frame; from the heap they fragment it, and every new one is page
+ * faulted in again.
+ *
+ * Pooled buffers are mapped one by one, rounded up to a size class
+ * (four to a power of two), the largest with a hint to use huge pages.
+ * A freed buffer goes on the list of its class for the next request of
+ * that class. Up to POOL_KEEP bytes are kept there; the kernel may take
+ * their pages back if it runs short of memory. Small buffers are plain
+ * malloc()s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fbv.h"
+
+#define POOL_MIN (16 << 10)		/* smaller buffers come from malloc() */
+#define POOL_KEEP (64 << 20)		/* free bytes kept for reuse */
+#define POOL_HUGE (2 << 20)		/* buffers from this size on ask for huge pages */
+#define POOL_CLASSES 128
+
+/* in front of every buffer, 64 bytes keep what follows aligned */
+union pool_header
+{
+	struct
+	{
+		size_t size;		/* mapped, header included; 0 if malloc()ed */
+		int cls;
+		union pool_header *next;	/* on a free list */
+	} b;
+	char align[64];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static union pool_header *free_list[POOL_CLASSES];
+static size_t kept;			/* bytes on the free lists */
+
+static struct
+{
+	unsigned long requests, reused;
+	size_t in_use, peak_in_use;
+	size_t mapped, peak_mapped;	/* in use and kept */
+} stats;
+
+static size_t class_size(int cls)
+{
+	return ((size_t) POOL_MIN << (cls / 4)) / 4 * (4 + cls % 4);
+}
+
+/* unmap the free buffers, called with the lock held */
+static void trim(void)
+{
+	union pool_header *h;
+	int cls;
+
+	for(cls = 0; cls < POOL_CLASSES; cls++)
+		while((h = free_list[cls]))
+		{
+			free_list[cls] = h->b.next;
+			stats.mapped -= h->b.size;
+			munmap(h, h->b.size);
+		}
+	kept = 0;
+}
+
+void *pool_alloc(size_t len)
+{
+	union pool_header *h;
+	size_t n = len + sizeof(union pool_header);
+	int cls;
+
+	if(n < POOL_MIN)
+	{
+		if(!(h = (union pool_header *) malloc(n)))
+			return NULL;
+		h->b.size = 0;
+		return h + 1;
+	}
+	for(cls = 0; class_size(cls) < n; cls++)
+		if(cls + 1 == POOL_CLASSES)
+			return NULL;
+	n = class_size(cls);
+
+	pthread_mutex_lock(&lock);
+	stats.requests++;
+	if((h = free_list[cls]))
+	{
+		free_list[cls] = h->b.next;
+		kept -= n;
+		stats.reused++;
+	}
+	else
+	{
+		h = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(h == MAP_FAILED && kept)
+		{
+			/* what is kept for later is better spent now */
+			trim();
+			h = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+		if(h == MAP_FAILED)
+		{
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if(n >= POOL_HUGE)
+			madvise(h, n, MADV_HUGEPAGE);
+#endif
+		h->b.size = n;
+		h->b.cls = cls;
+		stats.mapped += n;
+		stats.peak_mapped = max(stats.peak_mapped, stats.mapped);
+	}
+	stats.in_use += n;
+	stats.peak_in_use = max(stats.peak_in_use, stats.in_use);
+	pthread_mutex_unlock(&lock);
+	return h + 1;
+}
+
+void pool_free(void *p)
+{
+	union pool_header *h;
+#ifdef MADV_FREE
+	static long page;
+#endif
+
+	if(!p)
+		return;
+	h = (union pool_header *) p - 1;
+	if(!h->b.size)
+	{
+		free(h);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	stats.in_use -= h->b.size;
+	if(kept + h->b.size <= POOL_KEEP)
+	{
+#ifdef MADV_FREE
+		/* the pages may go, all but the first one with the header */
+		if(!page)
+			page = sysconf(_SC_PAGESIZE);
+		if(page > 0 && h->b.size > (size_t) page)
+			madvise((char *) h + page, h->b.size - page, MADV_FREE);
+#endif
+		h->b.next = free_list[h->b.cls];
+		free_list[h->b.cls] = h;
+		kept += h->b.size;
+	}
+	else
+	{
+		stats.mapped -= h->b.size;
+		munmap(h, h->b.size);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void pool_report(void)
+{
+	pthread_mutex_lock(&lock);
+	fprintf(stderr, "pool: %lu of %lu buffers reused (%lu%%), peak %lu KB mapped, %lu KB in use\n",
+		stats.reused, stats.requests, stats.requests ? stats.reused * 100 / stats.requests : 0,
+		(unsigned long) (stats.peak_mapped >> 10), (unsigned long) (stats.peak_in_use >> 10));
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,168 @@
+/*
+    fbv  --  simple image viewer for the linux framebuffer
+    Copyright (C) 2000  Tomasz Sterna
+    Copyright (C) 2003  Mateusz Golicz
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * A small pool of worker threads for splitting row loops into bands.
+ *
+ * The workers are started once and sleep between jobs. threads_run()
+ * cuts [0, count) into one band per thread, the calling thread doing
+ * the first one, and returns when all bands are done. Jobs below the
+ * size threshold, or with a single thread, just run in the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "fbv.h"
+
+static pthread_t *workers;
+static int nworkers;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static struct
+{
+	threads_fn fn;
+	void *arg;
+	int count, bands;
+	int pending;			/* workers still busy */
+	unsigned int gen;		/* bumped for every job */
+	int quit;
+} job;
+
+static void run_band(int band)
+{
+	job.fn(job.arg, job.count * band / job.bands, job.count * (band + 1) / job.bands, band);
+}
+
+static void *worker(void *p)
+{
+	int id = (int) (long) p;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&lock);
+	for(;;)
+	{
+		while(job.gen == seen && !job.quit)
+			pthread_cond_wait(&go, &lock);
+		if(job.quit)
+			break;
+		seen = job.gen;
+
+		pthread_mutex_unlock(&lock);
+		if(id < job.bands)
+			run_band(id);
+		pthread_mutex_lock(&lock);
+
+		if(--job.pending == 0)
+			pthread_cond_signal(&done);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* 'threads' is the total, the caller included; 0 picks one per CPU (at most 4) */
+void threads_init(int threads)
+{
+	int i;
+
+	if(threads <= 0)
+		threads = min(max((int) sysconf(_SC_NPROCESSORS_ONLN), 1), 4);
+	if(threads <= 1)
+		return;
+
+	if(!(workers = (pthread_t *) malloc((threads - 1) * sizeof(pthread_t))))
+		return;
+	for(i = 1; i < threads; i++)
+	{
+		if(pthread_create(&workers[nworkers], NULL, worker, (void *) (long) i))
+		{
+			if (debugme) fprintf(stderr, "threads: could only start %d workers\n", nworkers);
+			break;
+		}
+		nworkers++;
+	}
+}
+
+void threads_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	job.quit = 1;
+	pthread_cond_broadcast(&go);
+	pthread_mutex_unlock(&lock);
+
+	for(i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+
+	/* as it was, so that threads_init() can start another pool */
+	job.quit = 0;
+	job.gen = 0;
+}
+
+/* how many bands a job may be split into, scratch space is sized by this */
+int threads_count(void)
+{
+	return nworkers + 1;
+}
+
+/*
+ * fn(arg, first, last, band) for bands of [0, count). 'cost' is the
+ * work per item (pixels in a row, say); a band gets at least
+ * THREADS_MIN_WORK of it.
+ */
+void threads_run(threads_fn fn, void *arg, int count, int cost)
+{
+	int bands = nworkers + 1;
+	long long work = (long long) count * max(cost, 1);
+
+	if(work / bands < THREADS_MIN_WORK)
+		bands = (int) (work / THREADS_MIN_WORK);
+	bands = min(bands, count);
+	if(bands <= 1)
+	{
+		fn(arg, 0, count, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	job.fn = fn;
+	job.arg = arg;
+	job.count = count;
+	job.bands = bands;
+	job.pending = nworkers;
+	job.gen++;
+	pthread_cond_broadcast(&go);
+	pthread_mutex_unlock(&lock);
+
+	run_band(0);
+
+	pthread_mutex_lock(&lock);
+	while(job.pending)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+}
@@ -18,158 +18,580 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include "fbv.h"
 
-unsigned char * simple_resize(unsigned char * orgin,int ox,int oy,int dx,int dy)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define FBV_SSE2
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FBV_NEON
+#endif
+
+/*
+ * Nearest neighbour source positions: tab[i] = i * o / d * scale for
+ * i <= d, stepped with a remainder instead of a multiply and a divide.
+ * NULL for an empty destination, or without memory.
+ */
+static int * nearest_table(int o, int d, int scale)
 {
-	unsigned char *cr,*p,*l;
-	int i,j,k,ip;
-	assert(cr = (unsigned char*) malloc(dx*dy*3));
-	l=cr;
-	
-	for(j=0;j<dy;j++,l+=dx*3)
+	int *tab, i, pos = 0, rem = 0, q, r;
+
+	if(d <= 0 || !(tab = (int*) malloc((d + 1) * sizeof(int))))
+		return(NULL);
+	q = o / d;
+	r = o % d;
+
+	for(i = 0; i <= d; i++)
+	{
+		tab[i] = pos * scale;
+		pos += q;
+		rem += r;
+		if(rem >= d)
+		{
+			rem -= d;
+			pos++;
+		}
+	}
+	return(tab);
+}
+
+/*
+ * The kernels below work on bands of destination rows, split over the
+ * worker threads by threads_run(); this is what a band gets to see.
+ */
+struct rows_job
+{
+	const unsigned char *src;
+	unsigned char *dst;
+	int ox, oy, dx, dy, ch;
+	const int *col, *row;		/* nearest neighbour or box tables */
+	unsigned int *sum;		/* column sums, ox * 3 per band */
+	const struct filter_table *h, *v;
+};
+
+/* rows that come from the same source row are copied, not scaled again */
+static void nearest_rows(void *arg, int first, int last, int band)
+{
+	struct rows_job *job = (struct rows_job *) arg;
+	int i, j, k, ch = job->ch, len = job->dx * ch;
+	const int *col = job->col;
+	unsigned char *l = job->dst + first * len;
+
+	for(j = first; j < last; j++, l += len)
 	{
-		p=orgin+(j*oy/dy*ox*3);
-		for(i=0,k=0;i<dx;i++,k+=3)
+		const unsigned char *p;
+
+		if(j > first && job->row[j] == job->row[j-1])
 		{
-			ip=i*ox/dx*3;
-			l[k]=p[ip];
-			l[k+1]=p[ip+1];
-			l[k+2]=p[ip+2];
+			memcpy(l, l - len, len);
+			continue;
 		}
+		p = job->src + job->row[j] * job->ox * ch;
+		if(ch == 3)
+			for(i = 0, k = 0; k < len; i++, k += 3)
+			{
+				const unsigned char *q = p + col[i];
+				l[k] = q[0];
+				l[k+1] = q[1];
+				l[k+2] = q[2];
+			}
+		else
+			for(i = 0; i < len; i++)
+				l[i] = p[col[i]];
 	}
+}
+
+unsigned char * simple_resize(unsigned char * orgin,int ox,int oy,int dx,int dy)
+{
+	struct rows_job job;
+	unsigned char *cr;
+	int *col,*row;
+	cr = (unsigned char*) pool_alloc(dx*dy*3);
+	col = nearest_table(ox, dx, 3);
+	row = nearest_table(oy, dy, 1);
+	if(!cr || !col || !row)
+	{
+		free(col);
+		free(row);
+		pool_free(cr);
+		return(NULL);
+	}
+
+	job.src = orgin; job.dst = cr;
+	job.ox = ox; job.dx = dx; job.ch = 3;
+	job.col = col; job.row = row;
+	threads_run(nearest_rows, &job, dy, dx);
+
+	free(col);
+	free(row);
 	return(cr);
 }
 
 unsigned char * alpha_resize(unsigned char * alpha,int ox,int oy,int dx,int dy)
 {
-	unsigned char *cr,*p,*l;
-	int i,j,k;
-	cr=(unsigned char*) malloc(dx*dy); l=cr;
-	
-	for(j=0;j<dy;j++,l+=dx)
+	struct rows_job job;
+	unsigned char *cr;
+	int *col,*row;
+	cr=(unsigned char*) pool_alloc(dx*dy);
+	if(!cr)
+		return(cr);
+	col = nearest_table(ox, dx, 1);
+	row = nearest_table(oy, dy, 1);
+	if(!col || !row)
 	{
-		p = alpha+(j*oy/dy*ox);
-		for(i=0,k=0;i<dx;i++)
-			l[k++]=p[i*ox/dx];
+		free(col);
+		free(row);
+		pool_free(cr);
+		return(NULL);
 	}
+
+	job.src = alpha; job.dst = cr;
+	job.ox = ox; job.dx = dx; job.ch = 1;
+	job.col = col; job.row = row;
+	threads_run(nearest_rows, &job, dy, dx);
+
+	free(col);
+	free(row);
 	
 	return(cr);
 }
 
-unsigned char * color_average_resize(unsigned char * orgin,int ox,int oy,int dx,int dy)
+/* 2x2 blocks into one pixel, an odd last row or column is left out */
+static void half_rows(void *arg, int first, int last, int band)
 {
-	unsigned char *cr,*p,*q;
-	int i,j,k,l,xa,xb,ya,yb;
-	int sq,r,g,b;
-	assert(cr=(unsigned char*) malloc(dx*dy*3)); p=cr;
+	struct rows_job *job = (struct rows_job *) arg;
+	int i, j, ch = job->ch, len = job->dx * ch;
+	/* a source of one pixel or one row is averaged with itself */
+	int right = (job->ox > 1) ? ch : 0, down = (job->oy > 1) ? job->ox * ch : 0;
+
+	for(j = first; j < last; j++)
+	{
+		const unsigned char *p = job->src + 2 * j * job->ox * ch, *q = p + down;
+		unsigned char *l = job->dst + j * len;
+
+		if(ch == 3)
+			for(i = 0; i < len; i += 3, p += 6, q += 6)
+			{
+				l[i] = (p[0] + p[right] + q[0] + q[right] + 2) >> 2;
+				l[i+1] = (p[1] + p[right+1] + q[1] + q[right+1] + 2) >> 2;
+				l[i+2] = (p[2] + p[right+2] + q[2] + q[right+2] + 2) >> 2;
+			}
+		else
+			for(i = 0; i < len; i++, p += 2, q += 2)
+				l[i] = (p[0] + p[right] + q[0] + q[right] + 2) >> 2;
+	}
+}
+
+/* 'ch' is 3 for an RGB image, 1 for an alpha channel; the size is ox/2 x oy/2, at least 1 */
+unsigned char * half_resize(unsigned char * orgin,int ox,int oy,int ch)
+{
+	struct rows_job job;
+	unsigned char *cr;
+	int dx = max(ox / 2, 1), dy = max(oy / 2, 1);
+
+	if(!(cr = (unsigned char*) pool_alloc(dx * dy * ch)))
+		return(cr);
+	job.src = orgin; job.dst = cr;
+	job.ox = ox; job.oy = oy; job.dx = dx; job.ch = ch;
+	threads_run(half_rows, &job, dy, dx * 4);
+	return(cr);
+}
+
+/* sum[k] (+)= q[k] for n bytes */
+static void add_row(unsigned int *sum, const unsigned char *q, int n, int first)
+{
+	int k = 0;
+
+#ifdef FBV_SSE2
+	__m128i zero = _mm_setzero_si128();
+
+	for(; k + 16 <= n; k += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (q + k));
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		__m128i s0 = _mm_unpacklo_epi16(lo, zero), s1 = _mm_unpackhi_epi16(lo, zero);
+		__m128i s2 = _mm_unpacklo_epi16(hi, zero), s3 = _mm_unpackhi_epi16(hi, zero);
+		__m128i *d = (__m128i *) (sum + k);
+
+		if(!first)
+		{
+			s0 = _mm_add_epi32(s0, _mm_loadu_si128(d));
+			s1 = _mm_add_epi32(s1, _mm_loadu_si128(d + 1));
+			s2 = _mm_add_epi32(s2, _mm_loadu_si128(d + 2));
+			s3 = _mm_add_epi32(s3, _mm_loadu_si128(d + 3));
+		}
+		_mm_storeu_si128(d, s0);
+		_mm_storeu_si128(d + 1, s1);
+		_mm_storeu_si128(d + 2, s2);
+		_mm_storeu_si128(d + 3, s3);
+	}
+#elif defined(FBV_NEON)
+	for(; k + 8 <= n; k += 8)
+	{
+		uint16x8_t v = vmovl_u8(vld1_u8(q + k));
+		uint32x4_t s0 = vmovl_u16(vget_low_u16(v)), s1 = vmovl_u16(vget_high_u16(v));
+
+		if(!first)
+		{
+			s0 = vaddq_u32(s0, vld1q_u32(sum + k));
+			s1 = vaddq_u32(s1, vld1q_u32(sum + k + 4));
+		}
+		vst1q_u32(sum + k, s0);
+		vst1q_u32(sum + k + 4, s1);
+	}
+#endif
+	for(; k < n; k++)
+		sum[k] = first ? q[k] : sum[k] + q[k];
+}
+
+/*
+ * Every output pixel is the average of the source box from i*ox/dx to
+ * (i+1)*ox/dx, both included, and the same for the rows. The rows of a
+ * box are first added up into column sums, then the column sums are
+ * added up over each box, so a source pixel is read about once instead
+ * of once per box.
+ */
+static void average_rows(void *arg, int first, int last, int band)
+{
+	struct rows_job *job = (struct rows_job *) arg;
+	const unsigned char *orgin = job->src;
+	unsigned char *p = job->dst + first * job->dx * 3;
+	unsigned int *sum = job->sum + band * job->ox * 3;
+	const int *col = job->col, *rows = job->row;
+	int i,j,k,l,ox=job->ox,oy=job->oy,dx=job->dx;
 	
-	for(j=0;j<dy;j++)
+	for(j=first;j<last;j++)
 	{
+		int ya=rows[j], yb=min(rows[j+1], oy-1);
+
+		for(l=ya;l<=yb;l++)
+			add_row(sum, orgin+l*ox*3, ox*3, l==ya);
 		for(i=0;i<dx;i++,p+=3)
 		{
-			xa=i*ox/dx;
-			ya=j*oy/dy;
-			xb=(i+1)*ox/dx; if(xb>=ox) xb=ox-1;
-			yb=(j+1)*oy/dy; if(yb>=oy) yb=oy-1;
-			for(l=ya,r=0,g=0,b=0,sq=0;l<=yb;l++)
+			int xa=col[i], xb=min(col[i+1], ox-1);
+			unsigned long long r=0,g=0,b=0;
+			unsigned int sq=(xb-xa+1)*(yb-ya+1), *c=sum+xa*3;
+
+			for(k=xa;k<=xb;k++,c+=3)
 			{
-				q=orgin+((l*ox+xa)*3);
-				for(k=xa;k<=xb;k++,q+=3,sq++)
-				{
-					r+=q[0]; g+=q[1]; b+=q[2];
-				}
+				r+=c[0]; g+=c[1]; b+=c[2];
 			}
 			p[0]=r/sq; p[1]=g/sq; p[2]=b/sq;
 		}
 	}
+}
+
+unsigned char * color_average_resize(unsigned char * orgin,int ox,int oy,int dx,int dy)
+{
+	struct rows_job job;
+	unsigned char *cr;
+	unsigned int *sum;
+	int *col,*rows;
+	cr=(unsigned char*) pool_alloc(dx*dy*3);
+	sum=(unsigned int*) malloc(ox*3*sizeof(unsigned int)*threads_count());
+	col = nearest_table(ox, dx, 1);
+	rows = nearest_table(oy, dy, 1);
+	if(!cr || !sum || !col || !rows)
+	{
+		free(col);
+		free(rows);
+		free(sum);
+		pool_free(cr);
+		return(NULL);
+	}
+
+	job.src = orgin; job.dst = cr;
+	job.ox = ox; job.oy = oy; job.dx = dx;
+	job.col = col; job.row = rows; job.sum = sum;
+	threads_run(average_rows, &job, dy, dx * max(oy / dy, 1));
+
+	free(sum);
+	free(col);
+	free(rows);
 	return(cr);
 }
 
-unsigned char * rotate(unsigned char *i, int ox, int oy, int rot)
+/*
+ * Separable filtered resize, bilinear or Lanczos-3: a horizontal pass
+ * into a buffer of dx x oy, then a vertical one. Every output position
+ * has a precomputed window of source positions with 14 bit fixed point
+ * weights that sum to exactly 1.0. When shrinking the filter is
+ * stretched over the source pixels an output pixel covers.
+ */
+
+#define WEIGHT_BITS 14
+#define WEIGHT_PAIR(a, b) ((int) ((unsigned short) (a) | ((unsigned int) (unsigned short) (b) << 16)))
+
+struct filter_table
 {
-	unsigned char * n, * p;
-	int x, y;
-	assert(n = (unsigned char*) malloc(ox * oy * 3));
-	
-	switch(rot)
+	int taps;			/* source positions per output position */
+	int *start;			/* first of them, per output position */
+	short *w;			/* taps weights per output position */
+};
+
+static double lanczos3(double x)
+{
+	if(x < 0)
+		x = -x;
+	if(x < 1e-8)
+		return(1.0);
+	if(x >= 3.0)
+		return(0.0);
+	return(3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x));
+}
+
+static double triangle(double x)
+{
+	if(x < 0)
+		x = -x;
+	return(x < 1.0 ? 1.0 - x : 0.0);
+}
+
+/* -1 for an empty source or destination, or no memory for the table */
+static int filter_table(struct filter_table *t, int o, int d, int filter)
+{
+	double support = (filter == RESIZE_LANCZOS) ? 3.0 : 1.0;
+	double scale, fscale;
+	double *fw;
+	int i, k;
+
+	if(o <= 0 || d <= 0)
+		return(-1);
+	scale = (double) o / d;
+	fscale = max(scale, 1.0);
+
+	t->taps = min((int) ceil(support * fscale) * 2 + 1, o);
+	t->start = (int*) malloc(d * sizeof(int));
+	t->w = (short*) malloc(d * t->taps * sizeof(short));
+	fw = (double*) malloc(t->taps * sizeof(double));
+	if(!t->start || !t->w || !fw)
 	{
-		case 1: /* 90 deg right */
-			p = n + (oy - 1) * 3;
-			for(y = 0; y<oy; y++, p -= 3)
-			{
-				unsigned char * r = p;
-				for(x = 0; x<ox; x++, r += oy * 3)
-				{
-					r[0] = *(i++);
-					r[1] = *(i++);
-					r[2] = *(i++);
-				}
-			}
-			break;
-		case 2: /* 180 deg */
-			i += ox * oy * 3; p = n;
-			for(y = ox * oy; y > 0; y--)
+		free(t->start);
+		free(t->w);
+		free(fw);
+		return(-1);
+	}
+
+	for(i = 0; i < d; i++)
+	{
+		double center = (i + 0.5) * scale - 0.5, sum = 0;
+		int start = (int) floor(center - support * fscale) + 1, total = 0, big = 0;
+		short *w = t->w + i * t->taps;
+
+		start = max(0, min(start, o - t->taps));
+		for(k = 0; k < t->taps; k++)
+		{
+			double x = (start + k - center) / fscale;
+			fw[k] = (filter == RESIZE_LANCZOS) ? lanczos3(x) : triangle(x);
+			sum += fw[k];
+		}
+		/* rounding errors go to the largest weight, the sum stays exact */
+		for(k = 0; k < t->taps; k++)
+		{
+			w[k] = (short) floor(fw[k] / sum * (1 << WEIGHT_BITS) + 0.5);
+			total += w[k];
+			if(w[k] > w[big])
+				big = k;
+		}
+		w[big] += (1 << WEIGHT_BITS) - total;
+		t->start[i] = start;
+	}
+	free(fw);
+	return(0);
+}
+
+static inline unsigned char clamp_weighted(int sum)
+{
+	sum = (sum + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+	return(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+}
+
+/* one row, 'ch' bytes a pixel */
+static void filter_row_h(unsigned char *dst, const unsigned char *src, const struct filter_table *t, int d, int ch, int last)
+{
+	int i, k, c;
+
+#ifdef FBV_SSE2
+	/* two taps at a time: their bytes interleaved, times the weight pair */
+	if(ch == 3 && !last)
+	{
+		__m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+		for(i = 0; i < d; i++, dst += 3)
+		{
+			const unsigned char *p = src + t->start[i] * 3;
+			const short *w = t->w + i * t->taps;
+			__m128i acc = _mm_setzero_si128(), a, b;
+			unsigned int v;
+
+			for(k = 0; k + 1 < t->taps; k += 2, p += 6)
 			{
-				i -= 3;
-				p[0] = i[0];
-				p[1] = i[1];
-				p[2] = i[2];
-				p += 3;
+				memcpy(&v, p, 4);
+				a = _mm_cvtsi32_si128(v);
+				memcpy(&v, p + 3, 4);
+				b = _mm_cvtsi32_si128(v);
+				a = _mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(a, _mm_set1_epi32(WEIGHT_PAIR(w[k], w[k + 1]))));
 			}
-			break;
-		case 3: /* 90 deg left */
-			p = n;
-			for(y = 0; y<oy; y++, p += 3)
+			if(k < t->taps)
 			{
-				unsigned char * r = p + ((ox * 3) * oy);
-				for(x = 0; x<ox; x++)
-				{
-					r -= oy * 3;
-					r[0] = *(i++);
-					r[1] = *(i++);
-					r[2] = *(i++);
-				}
+				memcpy(&v, p, 4);
+				a = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(a, _mm_set1_epi32(WEIGHT_PAIR(w[k], 0))));
 			}
-			break;
+			acc = _mm_srai_epi32(_mm_add_epi32(acc, round), WEIGHT_BITS);
+			acc = _mm_packs_epi32(acc, acc);
+			v = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+			dst[0] = v;
+			dst[1] = v >> 8;
+			dst[2] = v >> 16;
+		}
+		return;
+	}
+#endif
+	for(i = 0; i < d; i++)
+	{
+		const unsigned char *p = src + t->start[i] * ch;
+		const short *w = t->w + i * t->taps;
+
+		for(c = 0; c < ch; c++)
+		{
+			int sum = 0;
+			for(k = 0; k < t->taps; k++)
+				sum += w[k] * p[k * ch + c];
+			*dst++ = clamp_weighted(sum);
+		}
 	}
-	return(n);
 }
 
-unsigned char * alpha_rotate(unsigned char *i, int ox, int oy, int rot)
+/* one output row from t->taps rows of the horizontal pass, 'len' bytes each */
+static void filter_row_v(unsigned char *dst, unsigned char *src, int len, const short *w, int taps)
 {
-	unsigned char * n, * p;
-	int x, y;
-	assert(n = (unsigned char*) malloc(ox * oy));
-	
-	switch(rot)
+	int x = 0, k;
+
+#ifdef FBV_SSE2
 	{
-		case 1: /* 90 deg right */
-			p = n + (oy - 1);
-			for(y = 0; y<oy; y++, p --)
-			{
-				unsigned char * r = p;
-				for(x = 0; x<ox; x++, r += oy)
-					*r = *(i++);
-			}
-			break;
-		case 2: /* 180 deg */
-			i += ox * oy; p = n;
-			for(y = ox * oy; y > 0; y--)
-				*(p++) = *(i--);
-			break;
-		case 3: /* 90 deg left */
-			p = n;
-			for(y = 0; y<oy; y++, p++)
+		__m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+		for(; x + 16 <= len; x += 16)
+		{
+			__m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+			for(k = 0; k < taps; k += 2)
 			{
-				unsigned char * r = p + (ox * oy);
-				for(x = 0; x<ox; x++)
+				__m128i a = _mm_loadu_si128((const __m128i *) (src + k * len + x)), b, lo, hi, wp;
+
+				if(k + 1 < taps)
+				{
+					b = _mm_loadu_si128((const __m128i *) (src + (k + 1) * len + x));
+					wp = _mm_set1_epi32(WEIGHT_PAIR(w[k], w[k + 1]));
+				}
+				else
 				{
-					r -= oy;
-					*r = *(i++);
+					b = zero;
+					wp = _mm_set1_epi32(WEIGHT_PAIR(w[k], 0));
 				}
+				lo = _mm_unpacklo_epi8(a, b);
+				hi = _mm_unpackhi_epi8(a, b);
+				acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wp));
+				acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wp));
+				acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wp));
+				acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wp));
 			}
-			break;
+			acc0 = _mm_packs_epi32(_mm_srai_epi32(acc0, WEIGHT_BITS), _mm_srai_epi32(acc1, WEIGHT_BITS));
+			acc2 = _mm_packs_epi32(_mm_srai_epi32(acc2, WEIGHT_BITS), _mm_srai_epi32(acc3, WEIGHT_BITS));
+			_mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(acc0, acc2));
+		}
+	}
+#elif defined(FBV_NEON)
+	for(; x + 8 <= len; x += 8)
+	{
+		int32x4_t acc0 = vdupq_n_s32(1 << (WEIGHT_BITS - 1)), acc1 = acc0;
+
+		for(k = 0; k < taps; k++)
+		{
+			int16x8_t a = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src + k * len + x)));
+
+			acc0 = vmlal_n_s16(acc0, vget_low_s16(a), w[k]);
+			acc1 = vmlal_n_s16(acc1, vget_high_s16(a), w[k]);
+		}
+		vst1_u8(dst + x, vqmovun_s16(vcombine_s16(vqshrn_n_s32(acc0, WEIGHT_BITS), vqshrn_n_s32(acc1, WEIGHT_BITS))));
+	}
+#endif
+	for(; x < len; x++)
+	{
+		int sum = 0;
+		for(k = 0; k < taps; k++)
+			sum += w[k] * src[k * len + x];
+		dst[x] = clamp_weighted(sum);
 	}
-	return(n);
+}
+
+/* job->src rows into the dx wide buffer job->dst ... */
+static void filter_h_rows(void *arg, int first, int last, int band)
+{
+	struct rows_job *job = (struct rows_job *) arg;
+	int j, len = job->dx * job->ch;
+
+	for(j = first; j < last; j++)
+		filter_row_h(job->dst + j * len, job->src + j * job->ox * job->ch, job->h, job->dx, job->ch, j == job->oy - 1);
+}
+
+/* ... and from there into the final rows */
+static void filter_v_rows(void *arg, int first, int last, int band)
+{
+	struct rows_job *job = (struct rows_job *) arg;
+	const struct filter_table *v = job->v;
+	int j, len = job->dx * job->ch;
+
+	for(j = first; j < last; j++)
+		filter_row_v(job->dst + j * len, (unsigned char *) job->src + v->start[j] * len, len, v->w + j * v->taps, v->taps);
+}
+
+/* 'ch' is 3 for an RGB image, 1 for an alpha channel */
+unsigned char * filter_resize(unsigned char * orgin,int ox,int oy,int dx,int dy,int ch,int filter)
+{
+	struct filter_table h, v;
+	struct rows_job job;
+	unsigned char *cr, *tmp;
+	int len = dx * ch;
+
+	if(filter_table(&h, ox, dx, filter))
+		return(NULL);
+	if(filter_table(&v, oy, dy, filter))
+	{
+		free(h.start);
+		free(h.w);
+		return(NULL);
+	}
+	cr = (unsigned char*) pool_alloc(dx * dy * ch);
+	tmp = (unsigned char*) pool_alloc(len * oy);
+	if(!cr || !tmp)
+	{
+		pool_free(cr);
+		pool_free(tmp);
+		free(h.start);
+		free(h.w);
+		free(v.start);
+		free(v.w);
+		return(NULL);
+	}
+
+	job.ox = ox; job.oy = oy; job.dx = dx; job.ch = ch;
+	job.h = &h; job.v = &v;
+	job.src = orgin; job.dst = tmp;
+	threads_run(filter_h_rows, &job, oy, dx * h.taps);
+	job.src = tmp; job.dst = cr;
+	threads_run(filter_v_rows, &job, dy, dx * v.taps);
+
+	pool_free(tmp);
+	free(h.start);
+	free(h.w);
+	free(v.start);
+	free(v.w);
+	return(cr);
 }